@@ -0,0 +1,178 @@
+
+#include <addrdict.h>
+#include <errlog.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum { kAddrDictMagic = 0x3130305244444141ULL }; // "AADDR001"
+
+struct AddrDictHeader
+{
+    uint64_t magic;
+    uint64_t nbAddrs;
+    uint64_t checksum;
+};
+
+static uint8_t gEmptyKey[kRIPEMD160ByteSize] = { 0x52 };
+
+AddrDict::AddrDict()
+:   nbSaved(0)
+{
+    ids.setEmptyKey(gEmptyKey);
+}
+
+uint32_t AddrDict::add(
+    const uint8_t *hash160
+)
+{
+    auto i = ids.find(hash160);
+    if(likely(ids.end()!=i)) return i->second;
+
+    if(unlikely(kNone<=hashes.size())) errFatal("too many addresses for the address dictionary");
+
+    uint8_t *key = allocHash160();
+    memcpy(key, hash160, kRIPEMD160ByteSize);
+
+    uint32_t id = hashes.size();
+    hashes.push_back(key);
+    ids[key] = id;
+    return id;
+}
+
+uint32_t AddrDict::find(
+    const uint8_t *hash160
+) const
+{
+    auto i = ids.find(hash160);
+    return (ids.end()==i) ? kNone : i->second;
+}
+
+bool AddrDict::load(
+    const std::string &fileName
+)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(fd, &statBuf);
+    if(r<0 || statBuf.st_size<(off_t)sizeof(AddrDictHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // Keys point straight into the mapping, which stays around for the whole run
+    size_t size = statBuf.st_size;
+    void *pMap = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(((void*)-1)==pMap) {
+        sysErr("failed to mmap address dictionary %s", fileName.c_str());
+        return false;
+    }
+
+    const AddrDictHeader *header = (const AddrDictHeader*)pMap;
+    const uint8_t *keys = (const uint8_t*)(header + 1);
+
+    size_t payloadSize = header->nbAddrs*kRIPEMD160ByteSize;
+    bool ok = (
+        kAddrDictMagic==header->magic                   &&
+        header->nbAddrs<kNone                           &&
+        size==(sizeof(AddrDictHeader) + payloadSize)    &&
+        header->checksum==checksum64(keys, payloadSize)
+    );
+
+    if(!ok) {
+        warning("address dictionary %s is damaged, ignoring it", fileName.c_str());
+        munmap(pMap, size);
+        return false;
+    }
+
+    ids.resize(header->nbAddrs);
+    hashes.reserve(header->nbAddrs);
+    for(uint64_t i=0; i<header->nbAddrs; ++i) {
+        const uint8_t *key = keys + i*kRIPEMD160ByteSize;
+        ids[key] = i;
+        hashes.push_back(key);
+    }
+
+    nbSaved = header->nbAddrs;
+    return true;
+}
+
+void AddrDict::save(
+    const std::string &fileName
+)
+{
+    if(nbSaved==hashes.size()) return;
+
+    std::vector<uint8_t> payload(hashes.size()*kRIPEMD160ByteSize);
+    for(size_t i=0; i<hashes.size(); ++i) {
+        memcpy(&payload[i*kRIPEMD160ByteSize], hashes[i], kRIPEMD160ByteSize);
+    }
+
+    AddrDictHeader header;
+    header.magic = kAddrDictMagic;
+    header.nbAddrs = hashes.size();
+    header.checksum = checksum64(payload.data(), payload.size());
+
+    std::string tmpName = fileName + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) {
+        warning("couldn't open %s for writing (%s)", tmpName.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = (
+        1==fwrite(&header, sizeof(header), 1, f)    &&
+        (0==payload.size() || 1==fwrite(payload.data(), payload.size(), 1, f))
+    );
+    ok = (0==fclose(f)) && ok;
+    if(ok) ok = (0==rename(tmpName.c_str(), fileName.c_str()));
+    if(!ok) {
+        warning("failed to write address dictionary %s (%s)", fileName.c_str(), strerror(errno));
+        unlink(tmpName.c_str());
+        return;
+    }
+
+    nbSaved = hashes.size();
+}
+
+static AddrDict *gAddrDict;
+
+static std::string addrDictFileName()
+{
+    // Ids are only dense for one chain: each datadir gets its own dictionary
+    const std::string &cacheDir = getSourceCacheDir();
+    if(0==cacheDir.size()) return cacheDir;
+    return cacheDir + "addrs.dict";
+}
+
+static void saveAddrDict()
+{
+    std::string fileName = addrDictFileName();
+    if(0!=fileName.size()) gAddrDict->save(fileName);
+}
+
+AddrDict &getAddrDict()
+{
+    if(unlikely(0==gAddrDict)) {
+
+        gAddrDict = new AddrDict;
+
+        std::string fileName = addrDictFileName();
+        if(0!=fileName.size()) {
+            if(gAddrDict->load(fileName)) {
+                info("loaded %" PRIu64 " addresses from address dictionary %s", gAddrDict->size(), fileName.c_str());
+            }
+            atexit(saveAddrDict);
+        }
+    }
+    return *gAddrDict;
+}
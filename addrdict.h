@@ -0,0 +1,40 @@
+#ifndef __ADDRDICT_H__
+    #define __ADDRDICT_H__
+
+    #include <util.h>
+    #include <common.h>
+
+    #include <string>
+    #include <vector>
+
+    // Dense ids for hash160s, handed out in order of first appearance.
+    //
+    // Commands keep per-address state in flat vectors indexed by id instead of each building their own
+    // hash160 keyed map. The id mapping lives in the cache directory: ids given out during a run stay
+    // valid in later runs, which only ever append new addresses to it.
+    struct AddrDict
+    {
+        typedef GoogMap<Hash160, uint32_t, Hash160Hasher, Hash160Equal>::Map IdMap;
+
+        static const uint32_t kNone = ~0U;
+
+        IdMap                       ids;
+        std::vector<const uint8_t*> hashes;
+        uint64_t                    nbSaved;
+
+        AddrDict();
+
+        uint32_t add(const uint8_t *hash160);          // id of hash160, a fresh one if it was never seen
+        uint32_t find(const uint8_t *hash160) const;   // id of hash160, kNone if it was never seen
+        bool load(const std::string &fileName);
+        void save(const std::string &fileName);
+
+        const uint8_t *hash(uint32_t id) const { return hashes[id];    }
+        uint64_t       size()            const { return hashes.size(); }
+    };
+
+    // The dictionary shared by all commands: loaded from the cache directory on first use, saved back at exit
+    AddrDict &getAddrDict();
+
+#endif // __ADDRDICT_H__
+
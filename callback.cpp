@@ -17,6 +17,15 @@ Callback::Callback()
     callbacks->push_back(this);
 }
 
+Callback::Callback(
+    bool listed
+)
+{
+    if(!listed) return;
+    if(0==callbacks) callbacks = new std::vector<Callback*>;
+    callbacks->push_back(this);
+}
+
 Callback *Callback::find(
     const char *name,
     bool printList
@@ -136,3 +145,148 @@ void Callback::showAllHelps(
     printf("\n");
 }
 
+
+// Runs several commands in a single pass over the chain
+struct MultiCallback:public Callback
+{
+    std::vector<Callback*> v;
+
+    MultiCallback(
+        const std::vector<Callback*> &_v
+    )
+    :   Callback(false),
+        v(_v)
+    {
+    }
+
+    #define FOR_ALL(x) for(size_t i=0; i<v.size(); ++i) v[i]->x
+
+    virtual const char                   *name() const         { return v[0]->name();         }
+    virtual const optparse::OptionParser *optionParser() const { return v[0]->optionParser(); }
+
+    virtual bool needTXHash() const
+    {
+        for(size_t i=0; i<v.size(); ++i) {
+            if(v[i]->needTXHash()) return true;
+        }
+        return false;
+    }
+
+    virtual uint32_t needs() const
+    {
+        // Coinbase only is a restriction: it only holds if every command is fine with it
+        uint32_t result = kNeedCoinbaseOnly;
+        for(size_t i=0; i<v.size(); ++i) {
+            uint32_t n = v[i]->needs();
+            result |= (n & ~kNeedCoinbaseOnly);
+            if(0==(n & kNeedCoinbaseOnly)) result &= ~kNeedCoinbaseOnly;
+        }
+        return result;
+    }
+
+    virtual Callback *clone()
+    {
+        std::vector<Callback*> shards;
+        for(size_t i=0; i<v.size(); ++i) {
+            Callback *shard = v[i]->clone();
+            if(0==shard) {
+                for(size_t j=0; j<shards.size(); ++j) delete shards[j];
+                return 0;
+            }
+            shards.push_back(shard);
+        }
+        return new MultiCallback(shards);
+    }
+
+    virtual void merge(
+        Callback *c
+    )
+    {
+        MultiCallback *shard = (MultiCallback*)c;
+        for(size_t i=0; i<v.size(); ++i) {
+            v[i]->merge(shard->v[i]);
+            delete shard->v[i];
+        }
+        shard->v.clear();
+    }
+
+    virtual void     startMap(const uint8_t *p                     ) { FOR_ALL(startMap(p));          }
+    virtual void       endMap(const uint8_t *p                     ) { FOR_ALL(endMap(p));            }
+    virtual void   startBlock(const uint8_t *p                     ) { FOR_ALL(startBlock(p));        }
+    virtual void     endBlock(const uint8_t *p                     ) { FOR_ALL(endBlock(p));          }
+    virtual void        start(  const Block *s, const Block *e     ) { FOR_ALL(start(s, e));          }
+    virtual void      startTX(const uint8_t *p, const uint8_t *hash) { FOR_ALL(startTX(p, hash));     }
+    virtual void        endTX(const uint8_t *p                     ) { FOR_ALL(endTX(p));             }
+    virtual void  startInputs(const uint8_t *p                     ) { FOR_ALL(startInputs(p));       }
+    virtual void    endInputs(const uint8_t *p                     ) { FOR_ALL(endInputs(p));         }
+    virtual void   startInput(const uint8_t *p                     ) { FOR_ALL(startInput(p));        }
+    virtual void     endInput(const uint8_t *p                     ) { FOR_ALL(endInput(p));          }
+    virtual void startOutputs(const uint8_t *p                     ) { FOR_ALL(startOutputs(p));      }
+    virtual void   endOutputs(const uint8_t *p                     ) { FOR_ALL(endOutputs(p));        }
+    virtual void  startOutput(const uint8_t *p                     ) { FOR_ALL(startOutput(p));       }
+    virtual void   startBlock(  const Block *b, uint64_t chainSize ) { FOR_ALL(startBlock(b, chainSize)); }
+    virtual void     endBlock(  const Block *b                     ) { FOR_ALL(endBlock(b));          }
+    virtual void       wrapup(                                     ) { FOR_ALL(wrapup());             }
+
+    // Only to the commands that asked for it: the others may do per-event work in there too
+    virtual void processBlock(
+        const BlockBatch &b
+    )
+    {
+        for(size_t i=0; i<v.size(); ++i) {
+            if(v[i]->needs() & kNeedBatch) v[i]->processBlock(b);
+        }
+    }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        uint64_t      value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const ScriptInfo *info
+    )
+    {
+        FOR_ALL(endOutput(p, value, txHash, outputIndex, outputScript, outputScriptSize, info));
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
+    )
+    {
+        FOR_ALL(
+            edge(
+                value,
+                upTXHash,
+                outputIndex,
+                outputScript,
+                outputScriptSize,
+                downTXHash,
+                inputIndex,
+                inputScript,
+                inputScriptSize,
+                info
+            )
+        );
+    }
+
+    #undef FOR_ALL
+};
+
+Callback *Callback::combine(
+    const std::vector<Callback*> &v
+)
+{
+    if(1==v.size()) return v[0];
+    return new MultiCallback(v);
+}
@@ -5,15 +5,62 @@
     #include <vector>
     #include <common.h>
     #include <option.h>
+    #include <util.h>
+
+    // What a callback consumes during the second pass (see Callback::needs), the parser skips the rest
+    enum
+    {
+        kNeedTXEvents     = 1<<0,   // startTX, endTX
+        kNeedInputEvents  = 1<<1,   // startInputs, endInputs, startInput, endInput
+        kNeedOutputEvents = 1<<2,   // startOutputs, endOutputs, startOutput, endOutput
+        kNeedEdges        = 1<<3,   // edge (implies kNeedTXHash)
+        kNeedCoinbaseOnly = 1<<4,   // only the first TX of each block is parsed
+        kNeedBatch        = 1<<5,   // processBlock
+        kNeedBatchEdges   = 1<<6,   // spent outputs resolved into the batch, without edge calls (implies kNeedTXHash)
+        kNeedTXHash       = 1<<7,   // TX hashes passed to startTX, endOutput and edge
+        kNeedScriptInfo   = 1<<8,   // output scripts solved once by the parser and passed to endOutput and edge
+        kNeedAddrId       = 1<<9,   // solved scripts also carry the address dictionary id of their hash160 (implies kNeedScriptInfo)
+
+        kNeedEvents = kNeedTXEvents | kNeedInputEvents | kNeedOutputEvents,
+    };
+
+    // One fully parsed block, laid out as flat arrays (see Callback::processBlock)
+    struct BlockBatch
+    {
+        const Block    *block;
+        uint64_t       nbTX;
+        uint64_t       nbInputs;
+        uint64_t       nbOutputs;
+
+        const uint8_t  *txHashes;                   // nbTX hashes of 32 bytes, 0 unless TX hashes are needed
+        const uint32_t *txInputs;                   // nbTX+1 entries: inputs of TX i are [txInputs[i], txInputs[i+1])
+        const uint32_t *txOutputs;                  // nbTX+1 entries: outputs of TX i are [txOutputs[i], txOutputs[i+1])
+
+        const uint64_t *outputValues;               // nbOutputs entries
+        const uint32_t *outputScriptOffsets;        // from block->data
+        const uint32_t *outputScriptSizes;
+
+        const uint8_t  *const *inputUpTXHashes;     // nbInputs entries: output spent by each input, as (upstream TX hash, index)
+        const uint32_t *inputUpIndices;
+        const uint32_t *inputScriptOffsets;         // from block->data
+        const uint32_t *inputScriptSizes;
+
+        const uint64_t *inputValues;                // nbInputs entries, only with kNeedEdges or kNeedBatchEdges (0 for coinbases)
+        const uint8_t  *const *inputUpScripts;      // script of the spent output, same conditions (0 for coinbases)
+        const uint32_t *inputUpScriptSizes;
+    };
 
     // Derive from this if you want to add a new command
     struct Callback
     {
         // Housekeeping
         Callback();
+        Callback(bool listed);
+        virtual ~Callback() {}
         typedef optparse::OptionParser Parser;
         static void showAllHelps(bool longHelp);
         static Callback *find(const char *name, bool printList=false);
+        static Callback *combine(const std::vector<Callback*> &v);          // One callback fanning all events out to several commands
 
         // Naming, option parsing, construction, etc ...
         virtual const char           *name(                            ) const = 0;              // Main name for callback
@@ -21,6 +68,9 @@
         virtual void               aliases(std::vector<const char *> &v) const {               } // Alternate names for callback
         virtual int                   init(int argc, const char *argv[])       { return 0;     } // Called after callback construction, with command line arguments
         virtual bool            needTXHash(                            ) const { return false; } // Overload if you need parser to compute TX hashes
+        virtual uint32_t             needs(                            ) const { return kNeedEvents | (needTXHash() ? kNeedEdges : 0); } // Overload to let parser skip the work you don't need
+        virtual Callback             *clone(                            )       { return 0;     } // Overload if blocks can be parsed independently: return a copy with empty results, parser then splits the chain across threads
+        virtual void                 merge(Callback *shard              )       {               } // Called in chain order to fold the results of a clone (which saw the next range of blocks) into this one
 
         // Callback for first, shallow parse -- all blocks are seen, including orphaned ones but aren't parsed
         virtual void     startMap(const uint8_t *p                     )       {               }  // Called when a blockchain file is mapped into memory
@@ -41,6 +91,7 @@
         virtual void  startOutput(const uint8_t *p                     )       {               }  // Called when a TX output is encountered
         virtual void   startBlock(  const Block *b, uint64_t chainSize )       {               }  // Called when a new block is encountered
         virtual void     endBlock(  const Block *b                     )       {               }  // Called when an end of block is encountered
+        virtual void processBlock(const BlockBatch &b                  )       {               }  // Called once a block has been parsed, right before endBlock, when needs() has kNeedBatch
         virtual void       wrapup(                                     )       {               }  // Called when the whole chain has been parsed
 
         // Called when an output has been fully parsed
@@ -50,7 +101,8 @@
             const uint8_t *txHash,              // sha256 of the current transaction
             uint64_t      outputIndex,          // Index of this output in the current transaction
             const uint8_t *outputScript,        // Raw script (challenge to would-be spender) carried by this output
-            uint64_t      outputScriptSize      // Byte size of raw script
+            uint64_t      outputScriptSize,     // Byte size of raw script
+            const ScriptInfo *info              // Output script as solved upfront, 0 unless kNeedScriptInfo
         )
         {
         }
@@ -65,7 +117,8 @@
             const uint8_t *downTXHash,          // sha256 of current (downstream) transaction
             uint64_t      inputIndex,           // Index of input in downstream transaction
             const uint8_t *inputScript,         // Raw script (answer to challenge) carried by input in downstream transaction
-            uint64_t      inputScriptSize       // Byte size of script carried by input in downstream transaction
+            uint64_t      inputScriptSize,      // Byte size of script carried by input in downstream transaction
+            const ScriptInfo *info              // Upstream output script as solved upfront, 0 unless kNeedScriptInfo
         )
         {
         }
@@ -7,16 +7,13 @@
 #include <option.h>
 #include <rmd160.h>
 #include <sha256.h>
+#include <addrdict.h>
 #include <callback.h>
 
 #include <vector>
+#include <algorithm>
 #include <string.h>
 
-struct Addr;
-static uint8_t emptyKey[kSHA256ByteSize] = { 0x52 };
-typedef GoogMap<Hash160, Addr*, Hash160Hasher, Hash160Equal>::Map AddrMap;
-typedef GoogMap<Hash160, int, Hash160Hasher, Hash160Equal>::Map RestrictMap;
-
 struct Output {
     int64_t time;
     int64_t value;
@@ -27,29 +24,34 @@ struct Output {
 };
 typedef std::vector<Output> OutputVec;
 
+// Indexed by address dictionary id (see addrdict.h), or by rank in the restrict list, all zeroes until the address shows up
 struct Addr
 {
     uint64_t sum;
     uint64_t nbIn;
     uint64_t nbOut;
-    uint160_t hash;
     uint32_t lastIn;
     uint32_t lastOut;
     OutputVec *outputVec;
 };
 
-template<> uint8_t *PagedAllocator<Addr>::pool = 0;
-template<> uint8_t *PagedAllocator<Addr>::poolEnd = 0;
-static inline Addr *allocAddr() { return (Addr*)PagedAllocator<Addr>::alloc(); }
-
 struct CompareAddr
 {
+    const std::vector<Addr> &addrs;
+
+    CompareAddr(
+        const std::vector<Addr> &_addrs
+    )
+    :   addrs(_addrs)
+    {
+    }
+
     bool operator()(
-        const Addr *const &a,
-        const Addr *const &b
+        const uint32_t &a,
+        const uint32_t &b
     ) const
     {
-        return (b->sum) < (a->sum);
+        return (addrs[b].sum) < (addrs[a].sum);
     }
 };
 
@@ -62,16 +64,17 @@ struct AllBalances:public Callback
     int64_t cutoffBlock;
     optparse::OptionParser parser;
 
-    AddrMap addrMap;
+    uint64_t nbAddrs;
     uint32_t blockTime;
     const Block *curBlock;
     const Block *lastBlock;
     const Block *firstBlock;
-    RestrictMap restrictMap;
-    std::vector<Addr*> allAddrs;
+    uint64_t nbRestricts;
+    std::vector<Addr> addrs;
     std::vector<uint160_t> restricts;
 
     AllBalances()
+    :   nbRestricts(0)
     {
         parser
             .usage("[options] [list of addresses to restrict output to]")
@@ -111,6 +114,7 @@ struct AllBalances:public Callback
     virtual const char                   *name() const         { return "allBalances"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;       }
     virtual bool                         needTXHash() const    { return true;          }
+    virtual uint32_t                          needs() const    { return kNeedOutputEvents | kNeedEdges | (nbRestricts ? kNeedScriptInfo : kNeedAddrId); }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -125,13 +129,11 @@ struct AllBalances:public Callback
     )
     {
         offset = 0;
+        nbAddrs = 0;
         curBlock = 0;
         lastBlock = 0;
         firstBlock = 0;
-
-        addrMap.setEmptyKey(emptyKey);
-        addrMap.resize(15 * 1000 * 1000);
-        allAddrs.reserve(15 * 1000 * 1000);
+        nbRestricts = 0;
 
         optparse::Values &values = parser.parse_args(argc, argv);
         cutoffBlock = values.get("atBlock");
@@ -155,14 +157,13 @@ struct AllBalances:public Callback
                 (uint64_t)restricts.size()
             );
 
-            auto e = restricts.end();
-            auto i = restricts.begin();
-            restrictMap.setEmptyKey(emptyKey);
-            while(e!=i) {
-                const uint160_t &h = *(i++);
-                restrictMap[h.v] = 1;
-            }
+            // A few addresses don't need the address dictionary, which would take in every address of the chain
+            std::sort(restricts.begin(), restricts.end(), lessHash160);
+            restricts.erase(std::unique(restricts.begin(), restricts.end(), sameHash160), restricts.end());
+            nbRestricts = restricts.size();
+            addrs.resize(nbRestricts, Addr());
         } else {
+            addrs.reserve(15 * 1000 * 1000);
             if(detailed) {
                 warning("asking for --detailed for *all* addresses in the blockchain will be *very* slow");
                 warning("as a matter of fact, it likely won't ever finish unless you have *lots* of RAM");
@@ -173,9 +174,25 @@ struct AllBalances:public Callback
         return 0;
     }
 
+    static bool lessHash160(const uint160_t &a, const uint160_t &b) { return memcmp(a.v, b.v, kRIPEMD160ByteSize)<0;  }
+    static bool sameHash160(const uint160_t &a, const uint160_t &b) { return 0==memcmp(a.v, b.v, kRIPEMD160ByteSize); }
+
+    // Rank of the script's address in the restrict list, kNone if it isn't one of the addresses asked for
+    uint32_t restrictId(
+        const ScriptInfo *info
+    ) const
+    {
+        if(unlikely(info->type<0)) return AddrDict::kNone;
+
+        uint160_t h;
+        memcpy(h.v, info->hash160, kRIPEMD160ByteSize);
+        auto i = std::lower_bound(restricts.begin(), restricts.end(), h, lessHash160);
+        if(restricts.end()==i || !sameHash160(*i, h)) return AddrDict::kNone;
+        return i - restricts.begin();
+    }
+
     void move(
-        const uint8_t *script,
-        uint64_t      scriptSize,
+        const ScriptInfo *info,
         const uint8_t *upTXHash,
         int64_t       outputIndex,
         int64_t       value,
@@ -183,38 +200,17 @@ struct AllBalances:public Callback
         uint64_t      inputIndex = -1
     )
     {
-        uint8_t addrType[3];
-        uint160_t pubKeyHash;
-        int type = solveOutputScript(pubKeyHash.v, script, scriptSize, addrType);
-        if(unlikely(type<0)) return;
-
-        if(0!=restrictMap.size()) {
-            auto r = restrictMap.find(pubKeyHash.v);
-            if(restrictMap.end()==r) {
-                return;
-            }
-        }
-
-        Addr *addr;
-        auto i = addrMap.find(pubKeyHash.v);
-        if(unlikely(addrMap.end()!=i)) {
-            addr = i->second;
-        } else {
+        uint32_t id = nbRestricts ? restrictId(info) : info->addrId;
+        if(unlikely(AddrDict::kNone==id)) return;
 
-            addr = allocAddr();
-
-            memcpy(addr->hash.v, pubKeyHash.v, kRIPEMD160ByteSize);
-            addr->outputVec = 0;
-            addr->nbOut = 0;
-            addr->nbIn = 0;
-            addr->sum = 0;
+        if(unlikely(addrs.size()<=id)) addrs.resize(1 + id, Addr());
 
+        Addr *addr = &addrs[id];
+        if(unlikely(0==(addr->nbIn | addr->nbOut))) {
+            ++nbAddrs;
             if(detailed) {
                 addr->outputVec = new OutputVec;
             }
-
-            addrMap[addr->hash.v] = addr;
-            allAddrs.push_back(addr);
         }
 
         if(0<value) {
@@ -244,12 +240,12 @@ struct AllBalances:public Callback
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
-        uint64_t      outputScriptSize
+        uint64_t      outputScriptSize,
+        const ScriptInfo *info
     )
     {
         move(
-            outputScript,
-            outputScriptSize,
+            info,
             txHash,
             outputIndex,
             value
@@ -278,12 +274,12 @@ struct AllBalances:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         move(
-            outputScript,
-            outputScriptSize,
+            info,
             upTXHash,
             outputIndex,
             -(int64_t)value,
@@ -298,14 +294,21 @@ struct AllBalances:public Callback
 
         info("sorting by balance ...");
 
-            CompareAddr compare;
-            auto e = allAddrs.end();
-            auto s = allAddrs.begin();
+            std::vector<uint32_t> ids;
+            ids.reserve(nbAddrs);
+            for(size_t id=0; id<addrs.size(); ++id) {
+                const Addr &addr = addrs[id];
+                if(0!=(addr.nbIn | addr.nbOut)) ids.push_back(id);
+            }
+
+            CompareAddr compare(addrs);
+            auto e = ids.end();
+            auto s = ids.begin();
             std::sort(s, e, compare);
 
         info("done\n");
 
-        uint64_t nbRestricts = (uint64_t)restrictMap.size();
+        const AddrDict *addrDict = nbRestricts ? 0 : &getAddrDict();
         if(0==nbRestricts) info("dumping all balances ...");
         else               info("dumping balances for %" PRIu64 " addresses ...", nbRestricts);
 
@@ -322,19 +325,17 @@ struct AllBalances:public Callback
             if(0<=limit && limit<=i)
                 break;
 
-            Addr *addr = *(s++);
-            if(0!=nbRestricts) {
-                auto r = restrictMap.find(addr->hash.v);
-                if(restrictMap.end()==r) continue;
-            }
+            uint32_t id = *(s++);
+            const Addr *addr = &addrs[id];
+            const uint8_t *hash = addrDict ? addrDict->hash(id) : restricts[id].v;
 
             printf("%24.8f ", (1e-8)*addr->sum);
-            showHex(addr->hash.v, kRIPEMD160ByteSize, false);
+            showHex(hash, kRIPEMD160ByteSize, false);
             if(0<addr->sum) ++nonZeroCnt;
 
             if(i<showAddr || 0!=nbRestricts) {
                 uint8_t buf[64];
-                hash160ToAddr(buf, addr->hash.v);
+                hash160ToAddr(buf, hash);
                 printf(" %s", buf);
             } else {
                 printf(" XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
@@ -370,10 +371,9 @@ struct AllBalances:public Callback
 
         info("done\n");
         info("found %" PRIu64 " addresses with non zero balance", nonZeroCnt);
-        info("found %" PRIu64 " addresses in total", (uint64_t)allAddrs.size());
+        info("found %" PRIu64 " addresses in total", nbAddrs);
         info("shown:%" PRIu64 " addresses", (uint64_t)i);
         printf("\n");
-        exit(0);
     }
 
     virtual void start(
@@ -420,7 +420,7 @@ struct AllBalances:public Callback
                 "eta = %5.2fs , "
                 ,
                 curBlock->height,
-                addrMap.size()*1e-6,
+                nbAddrs*1e-6,
                 100.0*progress,
                 elasedSinceStart,
                 (1.0/speed) - elasedSinceStart
@@ -437,6 +437,7 @@ struct AllBalances:public Callback
 
         if(0<=cutoffBlock && cutoffBlock<=curBlock->height) {
             wrapup();
+            exit(0);
         }
     }
 
@@ -6,6 +6,7 @@
 #include <errlog.h>
 #include <option.h>
 #include <rmd160.h>
+#include <addrdict.h>
 #include <callback.h>
 
 #include <vector>
@@ -13,9 +14,6 @@
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/connected_components.hpp>
 
-typedef uint160_t Addr;
-static uint8_t gEmptyKey[kRIPEMD160ByteSize] = { 0x52 };
-typedef GoogMap<Hash160, uint64_t, Hash160Hasher, Hash160Equal >::Map AddrMap;
 typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS> Graph;
 
 struct Closure:public Callback
@@ -23,12 +21,14 @@ struct Closure:public Callback
     optparse::OptionParser parser;
 
     Graph graph;
-    AddrMap addrMap;
     double startTime;
-    std::vector<Addr*> allAddrs;
     std::vector<uint64_t> vertices;
     std::vector<uint160_t> rootHashes;
 
+    // Graph vertices are numbered in order of first sight, the dictionary holds ids from earlier runs too
+    std::vector<uint32_t> vertexOf;         // by address id, kNone if not seen yet
+    std::vector<uint32_t> addrOf;           // by vertex
+
     Closure()
     {
         parser
@@ -42,6 +42,7 @@ struct Closure:public Callback
     virtual const char                   *name() const         { return "closure"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;   }
     virtual bool                         needTXHash() const    { return true;      }
+    virtual uint32_t                          needs() const    { return kNeedTXEvents | kNeedEdges | kNeedAddrId; }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -69,9 +70,6 @@ struct Closure:public Callback
             loadKeyList(rootHashes, addr);
         }
 
-        addrMap.setEmptyKey(gEmptyKey);
-        addrMap.resize(15 * 1000 * 1000);
-        allAddrs.reserve(15 * 1000 * 1000);
         info("Building address equivalence graph ...");
         startTime = usecs();
 
@@ -87,30 +85,27 @@ struct Closure:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
-        uint8_t addrType[3];
-        uint160_t pubKeyHash;
-        int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
-        if(unlikely(type<0)) return;
-
-        uint64_t a;
-        auto i = addrMap.find(pubKeyHash.v);
-        if(unlikely(addrMap.end()!=i))
-            a = i->second;
-        else {
-            Addr *addr = (Addr*)allocHash160();
-            memcpy(addr->v, pubKeyHash.v, kRIPEMD160ByteSize);
-            addrMap[addr->v] = a = allAddrs.size();
-            allAddrs.push_back(addr);
+        uint32_t id = info->addrId;
+        if(unlikely(AddrDict::kNone==id)) return;
+
+        if(unlikely(vertexOf.size()<=id)) vertexOf.resize(1 + id, AddrDict::kNone);
+        uint32_t &vertex = vertexOf[id];
+        if(unlikely(AddrDict::kNone==vertex)) {
+            vertex = addrOf.size();
+            addrOf.push_back(id);
         }
-
-        vertices.push_back(a);
+        vertices.push_back(vertex);
     }
 
     virtual void wrapup()
     {
+        // Vertices only ever seen alone in a TX have no edge, and aren't in the graph yet
+        while(boost::num_vertices(graph)<addrOf.size()) boost::add_vertex(graph);
+
         size_t size = boost::num_vertices(graph);
         info(
             "done, %.2f secs, found %" PRIu64 " address(es) \n",
@@ -129,6 +124,7 @@ struct Closure:public Callback
             nbCC
         );
 
+        const AddrDict &addrDict = getAddrDict();
         auto e = rootHashes.end();
         auto i = rootHashes.begin();
         while(e!=i) {
@@ -140,20 +136,20 @@ struct Closure:public Callback
             hash160ToAddr(b58, keyHash);
             info("Address cluster for address %s:", b58);
 
-            auto j = addrMap.find(keyHash);
-            if(unlikely(addrMap.end()==j)) {
+            // Ids known from earlier runs may never show up as a vertex in this one
+            uint64_t addrIndex = addrDict.find(keyHash);
+            if(AddrDict::kNone!=addrIndex) addrIndex = (addrIndex<vertexOf.size()) ? vertexOf[addrIndex] : AddrDict::kNone;
+            if(unlikely(AddrDict::kNone==addrIndex || cc.size()<=addrIndex)) {
                 warning("specified key was never used to spend coins");
                 showFullAddr(keyHash);
                 printf("\n");
                 count = 1;
             } else {
-                uint64_t addrIndex = j->second;
                 uint64_t homeComponentIndex = cc[addrIndex];
                 for(size_t k=0; likely(k<cc.size()); ++k) {
                     uint64_t componentIndex = cc[k];
                     if(unlikely(homeComponentIndex==componentIndex)) {
-                        Addr *addr = allAddrs[k];
-                        showFullAddr(addr->v);
+                        showFullAddr(addrDict.hash(addrOf[k]));
                         printf("\n");
                         ++count;
                     }
@@ -0,0 +1,102 @@
+
+// Copy the longest chain, in height order, to a chain store the parser can read instead of blk files
+
+#include <util.h>
+#include <store.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+
+struct Compact:public Callback
+{
+    optparse::OptionParser parser;
+
+    double startTime;
+    uint64_t nbBytes;
+    StoreWriter *writer;
+
+    Compact()
+    {
+        parser
+            .usage("[directory of the chain store, defaults to chain/ in the cache directory]")
+            .version("")
+            .description(
+                "write the blocks of the longest chain in height order to a new, contiguous chain store. "
+                "Point CHAINSTORE at it to have later runs read it instead of the blk files."
+            )
+            .epilog("")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "compact";         }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;           }
+    virtual bool                         needTXHash() const    { return false;             }
+    virtual uint32_t                     needs() const         { return kNeedCoinbaseOnly; }
+
+    virtual void aliases(
+        std::vector<const char*> &v
+    ) const
+    {
+        v.push_back("defrag");
+    }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+
+        std::string dir;
+        auto args = parser.args();
+        if(1<args.size()) {
+            dir = args[1];
+        } else {
+            const std::string &cacheDir = getCacheDir();
+            if(0==cacheDir.size()) errFatal("no chain store directory given, and caching is disabled");
+            dir = cacheDir + "chain/";
+        }
+        if('/'!=dir[dir.size()-1]) dir += '/';
+
+        // The blocks being copied may well live in there
+        if(dir==getStoreDir()) errFatal("can't compact chain store %s onto itself", dir.c_str());
+
+        info("writing chain store to %s", dir.c_str());
+        writer = new StoreWriter(dir);
+        startTime = usecs();
+        nbBytes = 0;
+        return 0;
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t
+    )
+    {
+        uint8_t hash[kSHA256ByteSize];
+        hashHeader(hash, b->data);
+
+        uint64_t size = 8 + ((const uint32_t*)b->data)[-1];
+        writer->add(hash, b->data - 8, size);
+        nbBytes += size;
+    }
+
+    virtual void wrapup()
+    {
+        writer->finish();
+        info(
+            "wrote %" PRIu64 " blocks (%.2f GB) in %d files, %.2f secs",
+            (uint64_t)writer->entries.size(),
+            nbBytes*1e-9,
+            (int)writer->fileSizes.size(),
+            1e-6*(usecs() - startTime)
+        );
+
+        delete writer;
+        writer = 0;
+    }
+};
+
+static Compact compact;
+
@@ -265,7 +265,8 @@ struct DumpTX:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         if(dump) {
@@ -326,7 +327,8 @@ struct DumpTX:public Callback
         const uint8_t *txHash,              // sha256 of the current transaction
         uint64_t      outputIndex,          // Index of this output in the current transaction
         const uint8_t *outputScript,        // Raw script (challenge to would-be spender) carried by this output
-        uint64_t      outputScriptSize      // Byte size of raw script
+        uint64_t      outputScriptSize,     // Byte size of raw script
+        const ScriptInfo *info              // Output script as solved upfront, 0 unless kNeedScriptInfo
     )
     {
         if(dump) {
@@ -86,6 +86,7 @@ struct FTS_UTXO: public Callback
     virtual const char                   *name() const         { return "fts_utxo"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;       }
     virtual bool                         needTXHash() const    { return true;          }
+    virtual uint32_t                          needs() const    { return kNeedTXEvents | kNeedOutputEvents | kNeedEdges; }
     virtual void aliases(std::vector<const char*> &v) const {  v.push_back("fts");   }
 
     virtual int init(int argc, const char *argv[])  {
@@ -209,7 +210,8 @@ struct FTS_UTXO: public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize)
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info)
         {
             inputs_scanned ++;
             curTxHasInputs = true;
@@ -229,7 +231,8 @@ struct FTS_UTXO: public Callback
         const uint8_t *txHash,              // sha256 of the current transaction
         uint64_t      outputIndex,          // Index of this output in the current transaction
         const uint8_t *outputScript,        // Raw script (challenge to would-be spender) carried by this output
-        uint64_t      outputScriptSize      // Byte size of raw script
+        uint64_t      outputScriptSize,     // Byte size of raw script
+        const ScriptInfo *info              // Output script as solved upfront, 0 unless kNeedScriptInfo
         )
         {
             outputs_scanned ++;
@@ -328,8 +331,6 @@ struct FTS_UTXO: public Callback
         endt = usecs();
         info("third  pass done in %.3f seconds\n", (endt - startThirdPass)*1e-6);
         std::cout << meaningless << std::endl;
-
-        exit(0);
     }
 
     virtual void startBlock(const Block *b, uint64_t chainSize)
@@ -339,6 +340,7 @@ struct FTS_UTXO: public Callback
 
         if(0<=cutoffBlock && cutoffBlock<=b->height) {
             wrapup();
+            exit(0);
         }
     }
 
@@ -85,6 +85,9 @@ struct Help:public Callback
         printf("    NOTE: <command> may have multiple aliases and can also be abbreviated. For\n");
         printf("          example, \"parser tx\", \"parser tr\", and \"parser transactions\" are equivalent.\n");
         printf("\n");
+        printf("    NOTE: several commands can share a single pass over the chain by separating them\n");
+        printf("          with a lone \"+\", e.g. \"parser allBalances -l 100 + rewards + stats\".\n");
+        printf("\n");
         printf("    NOTE: whenever specifying a list of things (e.g. a list of addresses), you can\n");
         printf("          instead enter \"file:list.txt\" and the list will be read from the file.\n");
         printf("\n");
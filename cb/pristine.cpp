@@ -35,6 +35,7 @@ struct Pristine:public Callback
     virtual const char                   *name() const         { return "pristine"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;    }
     virtual bool                         needTXHash() const    { return true;       }
+    virtual uint32_t                          needs() const    { return kNeedTXEvents | kNeedInputEvents | kNeedEdges; }
 
     virtual int init(
         int argc,
@@ -115,7 +116,8 @@ struct Pristine:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         auto i = txMap.find(upTXHash);
@@ -20,6 +20,7 @@ struct Rewards:public Callback
     const uint8_t *currTXHash;
 
     Rewards()
+    :   fullDump(false)
     {
         parser
             .usage("")
@@ -37,7 +38,8 @@ struct Rewards:public Callback
 
     virtual const char                   *name() const         { return "rewards"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;   }
-    virtual bool                         needTXHash() const    { return true;      }
+    virtual bool                         needTXHash() const    { return fullDump;  }
+    virtual uint32_t                          needs() const    { return kNeedEvents | kNeedCoinbaseOnly | (fullDump ? kNeedTXHash : 0); } // only the full dump shows TX hashes
 
     virtual int init(
         int argc,
@@ -100,7 +102,8 @@ struct Rewards:public Callback
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
-        uint64_t      outputScriptSize
+        uint64_t      outputScriptSize,
+        const ScriptInfo *info
     )
     {
         if(!hasGenInput) return;
@@ -31,6 +31,7 @@ struct SimpleStats:public Callback
     virtual const char                   *name() const         { return "simpleStats"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;       }
     virtual bool                         needTXHash() const    { return false;         }
+    virtual uint32_t                     needs() const         { return kNeedBatch;    }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -54,16 +55,38 @@ struct SimpleStats:public Callback
         return 0;
     }
 
-    virtual void endOutput(
-        const uint8_t *p,
-        uint64_t      value,
-        const uint8_t *txHash,
-        uint64_t      outputIndex,
-        const uint8_t *outputScript,
-        uint64_t      outputScriptSize
+    virtual Callback *clone()
+    {
+        SimpleStats *shard = new SimpleStats(*this);
+        shard->init(0, 0);
+        return shard;
+    }
+
+    virtual void merge(
+        Callback *c
+    )
+    {
+        SimpleStats *shard = (SimpleStats*)c;
+        nbMaps += shard->nbMaps;
+        volume += shard->volume;
+        nbBlocks += shard->nbBlocks;
+        nbInputs += shard->nbInputs;
+        nbOutputs += shard->nbOutputs;
+        nbValidBlocks += shard->nbValidBlocks;
+        nbTransactions += shard->nbTransactions;
+    }
+
+    virtual void processBlock(
+        const BlockBatch &b
     )
     {
-        volume += value;
+        uint64_t sum = 0;
+        for(uint64_t i=0; i<b.nbOutputs; ++i) sum += b.outputValues[i];
+
+        volume += sum;
+        nbInputs += b.nbInputs;
+        nbOutputs += b.nbOutputs;
+        nbTransactions += b.nbTX;
     }
 
     virtual void wrapup()
@@ -92,9 +115,6 @@ struct SimpleStats:public Callback
 
     virtual void     startMap(const uint8_t *p                     ) { ++nbMaps;        }
     virtual void   startBlock(const uint8_t *p                     ) { ++nbBlocks;      }
-    virtual void      startTX(const uint8_t *p, const uint8_t *hash) { ++nbTransactions;}
-    virtual void   startInput(const uint8_t *p                     ) { ++nbInputs;      }
-    virtual void  startOutput(const uint8_t *p                     ) { ++nbOutputs;     }
     virtual void   startBlock(  const Block *b, uint64_t           ) { ++nbValidBlocks; }
 };
 
@@ -64,6 +64,7 @@ struct SQLDump:public Callback
     virtual const char                   *name() const         { return "sqldump"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;   }
     virtual bool                         needTXHash() const    { return true;      }
+    virtual uint32_t                          needs() const    { return kNeedTXEvents | kNeedOutputEvents | kNeedEdges | kNeedScriptInfo; }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -182,10 +183,13 @@ struct SQLDump:public Callback
         uint64_t
     )
     {
-        if(0<=cutoffBlock && cutoffBlock<b->height) wrapup();
+        if(0<=cutoffBlock && cutoffBlock<b->height) {
+            wrapup();
+            exit(0);
+        }
 
         uint8_t blockHash[kSHA256ByteSize];
-        sha256Twice(blockHash, b->data, 80);
+        hashHeader(blockHash, b->data);
 
         const uint8_t *p = b->data;
         SKIP(uint32_t, version, p);
@@ -235,17 +239,15 @@ struct SQLDump:public Callback
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
-        uint64_t      outputScriptSize
+        uint64_t      outputScriptSize,
+        const ScriptInfo *info
     )
     {
         uint8_t address[40];
         address[0] = 'X';
         address[1] = 0;
 
-        uint8_t addrType[3];
-        uint160_t pubKeyHash;
-        int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
-        if(likely(0<=type)) hash160ToAddr(address, pubKeyHash.v);
+        if(likely(0<=info->type)) hash160ToAddr(address, info->hash160);
 
         // id BIGINT PRIMARY KEY
         // dstAddress CHAR(36)
@@ -287,7 +289,8 @@ struct SQLDump:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         uint256_t h;
@@ -326,7 +329,6 @@ struct SQLDump:public Callback
         fclose(blockFile);
         fclose(txFile);
         info("done\n");
-        exit(0);
     }
 };
 
@@ -67,6 +67,7 @@ struct Taint:public Callback
     virtual const char                   *name() const         { return "taint"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser; }
     virtual bool                         needTXHash() const    { return true;    }
+    virtual uint32_t                          needs() const    { return kNeedTXEvents | kNeedEdges; }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -158,7 +159,8 @@ struct Taint:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         auto e = taintMap.end();
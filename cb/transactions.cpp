@@ -46,6 +46,7 @@ struct Transactions:public Callback
     virtual const char                   *name() const         { return "transactions"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;        }
     virtual bool                         needTXHash() const    { return true;           }
+    virtual uint32_t                          needs() const    { return kNeedOutputEvents | kNeedEdges | kNeedScriptInfo; }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -96,27 +97,24 @@ struct Transactions:public Callback
     }
 
     void move(
-        const uint8_t *script,
-        uint64_t      scriptSize,
+        const ScriptInfo *info,
         const uint8_t *txHash,
         uint64_t       value,
         bool           add,
         const uint8_t *downTXHash = 0
     )
     {
-        uint8_t addrType[3];
-        uint160_t pubKeyHash;
-        int type = solveOutputScript(pubKeyHash.v, script, scriptSize, addrType);
-        if(unlikely(type<0)) return;
+        if(unlikely(info->type<0)) return;
 
-        bool match = (addrMap.end() != addrMap.find(pubKeyHash.v));
+        const uint8_t *pubKeyHash = info->hash160;
+        bool match = (addrMap.end() != addrMap.find(pubKeyHash));
         if(unlikely(match)) {
 
             int64_t newSum = sum + value*(add ? 1 : -1);
 
             if(csv) {
                 printf("%6" PRIu64 ", \"", bTime/86400 + 25569);
-                showHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
+                showHex(pubKeyHash, kRIPEMD160ByteSize, false);
                 printf("\", \"");
                 showHex(downTXHash ? downTXHash : txHash);
                 printf(
@@ -137,7 +135,7 @@ struct Transactions:public Callback
                 if(0<sz) timeBuf[sz-1] = 0;
 
                 printf("    %s    ", timeBuf);
-                showHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
+                showHex(pubKeyHash, kRIPEMD160ByteSize, false);
 
                 printf("    ");
                 showHex(downTXHash ? downTXHash : txHash);
@@ -163,12 +161,12 @@ struct Transactions:public Callback
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
-        uint64_t      outputScriptSize
+        uint64_t      outputScriptSize,
+        const ScriptInfo *info
     )
     {
         move(
-            outputScript,
-            outputScriptSize,
+            info,
             txHash,
             value,
             true
@@ -184,12 +182,12 @@ struct Transactions:public Callback
         const uint8_t *downTXHash,
         uint64_t      inputIndex,
         const uint8_t *inputScript,
-        uint64_t      inputScriptSize
+        uint64_t      inputScriptSize,
+        const ScriptInfo *info
     )
     {
         move(
-            outputScript,
-            outputScriptSize,
+            info,
             upTXHash,
             value,
             false,
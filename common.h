@@ -9,6 +9,9 @@
     #include <stdlib.h>
     #include <inttypes.h>
 
+    typedef signed int int128_t __attribute__((mode(TI)));
+    typedef unsigned int uint128_t __attribute__((mode(TI)));
+
     #if defined(__GNUC__)
         #define likely(x)   __builtin_expect((x), 1)
         #define unlikely(x) __builtin_expect((x), 0)
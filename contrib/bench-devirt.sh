@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Time allBalances with the generic (virtual dispatch) parse loop and with the
+# devirtualised one, and estimate the per-event dispatch overhead.
+#
+# usage: contrib/bench-devirt.sh [nbRuns]   (run from the top of the tree)
+
+NBRUNS=$1
+if test "$NBRUNS" = ""
+then
+    NBRUNS=5
+fi
+
+function build()
+{
+    make clean >/dev/null
+    make "$@" >/dev/null || exit 1
+}
+
+function best()
+{
+    BIN=$1
+    BEST=""
+    for i in `seq $NBRUNS`
+    do
+        T=`NBTHREADS=1 $BIN allBalances 2>&1 >/dev/null | grep "all done in" | awk '{print $5}'`
+        if test "$BEST" = "" || test `echo "$T < $BEST" | bc` = 1
+        then
+            BEST=$T
+        fi
+    done
+    echo $BEST
+}
+
+build
+cp parser .parser-virtual
+build DEVIRT=allBalances
+cp parser .parser-devirt
+
+# Number of TXs, inputs and outputs: each one costs at least one event
+EVENTS=`./.parser-virtual simpleStats 2>/dev/null | grep -E "nb(Inputs|Outputs|Transactions) =" | awk '{s+=$3} END {print s}'`
+
+TV=`best ./.parser-virtual`
+TD=`best ./.parser-devirt`
+echo "virtual   : $TV seconds"
+echo "devirt    : $TD seconds"
+echo "events    : $EVENTS"
+echo "ns/event  : `echo "scale=3; ($TV - $TD)*1000000000/$EVENTS" | bc`"
+
+rm -f .parser-virtual .parser-devirt
@@ -0,0 +1,273 @@
+#ifndef __FLATMAP_H__
+    #define __FLATMAP_H__
+
+    #include <new>
+    #include <type_traits>
+    #include <utility>
+    #include <stdlib.h>
+    #include <common.h>
+    #include <emmintrin.h>
+
+    // Open addressing hash map in the style of swiss tables.
+    //
+    // Each slot has a control byte holding 7 bits of its key's hash, or marking it empty or deleted.
+    // Slots come in aligned groups of 16 whose control bytes get matched against a hash in one go with
+    // SSE2, so a lookup usually reads one group of control bytes and the one slot that matches. Groups
+    // are probed in triangular order, and the table is kept at most 7/8 full, deleted slots included.
+    template<
+        typename Key,
+        typename Value,
+        typename Hasher,
+        typename Equal
+    >
+    struct FlatMap
+    {
+        typedef std::pair<const Key, Value> value_type;
+
+        enum { kGroupSize = 16 };
+        static const int8_t kEmpty = -128;
+        static const int8_t kDeleted = -2;
+
+        template<bool isConst>
+        struct Iter
+        {
+            typedef typename std::conditional<isConst, const value_type, value_type>::type Entry;
+
+            const FlatMap *map;
+            size_t        i;
+
+            Iter() : map(0), i(0) {}
+            Iter(const FlatMap *m, size_t j) : map(m), i(j) {}
+
+            template<bool c>
+            Iter(const Iter<c> &o) : map(o.map), i(o.i) {}
+
+            Entry &operator*()  const { return map->slots[i];  }
+            Entry *operator->() const { return map->slots + i; }
+
+            Iter &operator++()
+            {
+                do { ++i; } while(i<map->capacity && map->ctrl[i]<0);
+                return *this;
+            }
+
+            Iter operator++(int)
+            {
+                Iter r = *this;
+                ++*this;
+                return r;
+            }
+
+            bool operator==(const Iter &o) const { return i==o.i; }
+            bool operator!=(const Iter &o) const { return i!=o.i; }
+        };
+
+        typedef Iter<false> iterator;
+        typedef Iter<true>  const_iterator;
+
+        int8_t     *ctrl;
+        value_type *slots;
+        size_t     capacity;       // 0, or a power of two no smaller than kGroupSize
+        size_t     nbEntries;
+        size_t     nbDeleted;
+
+        FlatMap() : ctrl(0), slots(0), capacity(0), nbEntries(0), nbDeleted(0) {}
+
+        ~FlatMap()
+        {
+            destroy(ctrl, slots, capacity);
+        }
+
+        size_t         size()         const { return nbEntries;                                  }
+        size_t         bucket_count() const { return capacity;                                   }
+        uint64_t       memSize()      const { return capacity*(sizeof(value_type) + 1);          }
+        iterator       end()                { return iterator(this, capacity);                   }
+        const_iterator end()          const { return const_iterator(this, capacity);             }
+        iterator       begin()              { return iterator(this, firstFull());                }
+        const_iterator begin()        const { return const_iterator(this, firstFull());          }
+
+        static inline uint64_t hashOf(
+            const Key &key
+        )
+        {
+            uint64_t h = Hasher()(key) * 0x9E3779B97F4A7C15ULL;
+            return h ^ (h>>29);
+        }
+
+        inline size_t groupMask() const { return (capacity/kGroupSize) - 1; }
+
+        inline size_t findIndex(
+            const Key &key
+        ) const
+        {
+            if(unlikely(0==capacity)) return capacity;
+
+            uint64_t h = hashOf(key);
+            __m128i tag = _mm_set1_epi8((char)(h & 0x7F));
+            __m128i empty = _mm_set1_epi8(kEmpty);
+
+            size_t mask = groupMask();
+            size_t g = (h>>7) & mask;
+            for(size_t step=1; ; ++step) {
+
+                const int8_t *c = ctrl + g*kGroupSize;
+                __m128i group = _mm_load_si128((const __m128i*)c);
+
+                uint32_t match = _mm_movemask_epi8(_mm_cmpeq_epi8(group, tag));
+                while(match) {
+                    size_t i = g*kGroupSize + __builtin_ctz(match);
+                    if(likely(Equal()(slots[i].first, key))) return i;
+                    match &= match - 1;
+                }
+
+                if(likely(0!=_mm_movemask_epi8(_mm_cmpeq_epi8(group, empty)))) return capacity;
+                g = (g + step) & mask;
+            }
+        }
+
+        iterator       find(const Key &key)       { return iterator(this, findIndex(key));       }
+        const_iterator find(const Key &key) const { return const_iterator(this, findIndex(key)); }
+
+        Value &operator[](
+            const Key &key
+        )
+        {
+            size_t i = findIndex(key);
+            if(likely(i<capacity)) return slots[i].second;
+
+            if(unlikely(capacity*7<(nbEntries + nbDeleted + 1)*8)) {
+                bool mostlyDeleted = (nbEntries<nbDeleted);
+                rehash(0==capacity ? (size_t)kGroupSize : (mostlyDeleted ? capacity : 2*capacity));
+            }
+
+            uint64_t h = hashOf(key);
+            i = freeIndex(h);
+            nbDeleted -= (kDeleted==ctrl[i]);
+            ctrl[i] = (int8_t)(h & 0x7F);
+            new(slots + i) value_type(key, Value());
+            ++nbEntries;
+            return slots[i].second;
+        }
+
+        void erase(
+            iterator it
+        )
+        {
+            size_t i = it.i;
+            slots[i].~value_type();
+            --nbEntries;
+
+            // A group with an empty slot ends every probe that reaches it, so nothing lives past it
+            const int8_t *c = ctrl + (i & ~(size_t)(kGroupSize - 1));
+            __m128i group = _mm_load_si128((const __m128i*)c);
+            bool hasEmpty = (0!=_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(kEmpty))));
+            if(hasEmpty) {
+                ctrl[i] = kEmpty;
+            } else {
+                ctrl[i] = kDeleted;
+                ++nbDeleted;
+            }
+        }
+
+        void resize(
+            size_t n
+        )
+        {
+            size_t wanted = kGroupSize;
+            while(wanted*7<n*8) wanted *= 2;
+            if(capacity<wanted) rehash(wanted);
+        }
+
+        // Mean number of groups a lookup of a present key reads
+        double meanProbeLength() const
+        {
+            if(0==nbEntries) return 0;
+
+            uint64_t total = 0;
+            size_t mask = groupMask();
+            for(size_t i=0; i<capacity; ++i) {
+                if(ctrl[i]<0) continue;
+                size_t home = (hashOf(slots[i].first)>>7) & mask;
+                size_t g = home;
+                size_t n = 1;
+                for(size_t step=1; g!=(i/kGroupSize); ++step) {
+                    g = (g + step) & mask;
+                    ++n;
+                }
+                total += n;
+            }
+            return total/(double)nbEntries;
+        }
+
+    private:
+
+        FlatMap(const FlatMap &);
+        FlatMap &operator=(const FlatMap &);
+
+        size_t firstFull() const
+        {
+            size_t i = 0;
+            while(i<capacity && ctrl[i]<0) ++i;
+            return i;
+        }
+
+        // First empty or deleted slot on the probe sequence of h
+        size_t freeIndex(
+            uint64_t h
+        ) const
+        {
+            size_t mask = groupMask();
+            size_t g = (h>>7) & mask;
+            for(size_t step=1; ; ++step) {
+                const int8_t *c = ctrl + g*kGroupSize;
+                uint32_t avail = _mm_movemask_epi8(_mm_load_si128((const __m128i*)c));
+                if(likely(0!=avail)) return g*kGroupSize + __builtin_ctz(avail);
+                g = (g + step) & mask;
+            }
+        }
+
+        void rehash(
+            size_t newCapacity
+        )
+        {
+            int8_t *oldCtrl = ctrl;
+            value_type *oldSlots = slots;
+            size_t oldCapacity = capacity;
+
+            void *c = 0;
+            if(0!=posix_memalign(&c, kGroupSize, newCapacity)) throw std::bad_alloc();
+            slots = (value_type*)malloc(newCapacity*sizeof(value_type));
+            if(0==slots) throw std::bad_alloc();
+
+            ctrl = (int8_t*)c;
+            capacity = newCapacity;
+            nbDeleted = 0;
+            for(size_t i=0; i<capacity; ++i) ctrl[i] = kEmpty;
+
+            for(size_t i=0; i<oldCapacity; ++i) {
+                if(oldCtrl[i]<0) continue;
+                uint64_t h = hashOf(oldSlots[i].first);
+                size_t j = freeIndex(h);
+                ctrl[j] = (int8_t)(h & 0x7F);
+                new(slots + j) value_type(oldSlots[i]);
+            }
+
+            destroy(oldCtrl, oldSlots, oldCapacity);
+        }
+
+        static void destroy(
+            int8_t     *c,
+            value_type *s,
+            size_t     n
+        )
+        {
+            for(size_t i=0; i<n; ++i) {
+                if(0<=c[i]) s[i].~value_type();
+            }
+            free(c);
+            free(s);
+        }
+    };
+
+#endif // __FLATMAP_H__
+
@@ -0,0 +1,465 @@
+
+#include <io.h>
+#include <errlog.h>
+
+#include <atomic>
+#include <algorithm>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup)
+    #include <linux/io_uring.h>
+#endif
+
+#if !defined(O_DIRECT)
+#   define O_DIRECT 0
+#endif
+
+enum
+{
+    kAlign = 4096,                  // O_DIRECT wants offsets, sizes and buffers aligned on the device block size
+    kChunkSize = 2*1024*1024,
+    kProbeSize = 16*1024,           // first read after a jump with the headers backend, doubles while reads stay sequential
+    kUringDepth = 4,                // reads in flight per stream
+    kAdviseAhead = 32*1024*1024,    // how far ahead of the reader mmap gets told to fetch
+};
+
+static const char *gIOBackendNames[kNbIOBackends] = { "mmap", "pread", "uring", "headers" };
+static std::atomic<uint64_t> gBytesRead(0);
+
+int getIOBackend()
+{
+    static int backend = -1;
+    if(unlikely(backend<0)) {
+        backend = kIOMmap;
+        const char *name = getenv("IO");
+        if(name) {
+            int forced = -1;
+            for(int i=0; i<kNbIOBackends; ++i) {
+                if(0==strcmp(name, gIOBackendNames[i])) forced = i;
+            }
+            if(forced<0) warning("unknown I/O backend %s, ignoring it", name);
+            else         backend = forced;
+        }
+    }
+    return backend;
+}
+
+const char *ioBackendName(
+    int backend
+)
+{
+    return gIOBackendNames[backend];
+}
+
+uint64_t getIOBytesRead()
+{
+    return gBytesRead;
+}
+
+static uint8_t *allocAligned(
+    size_t size
+)
+{
+    void *p = 0;
+    if(0!=posix_memalign(&p, kAlign, size)) errFatal("failed to allocate %d bytes of I/O buffers", (int)size);
+    return (uint8_t*)p;
+}
+
+// Some file systems won't do O_DIRECT at all: fall back to buffered reads there
+static int openDirect(
+    const std::string &name
+)
+{
+    int fd = open(name.c_str(), O_RDONLY | O_DIRECT);
+    if(fd<0) fd = open(name.c_str(), O_RDONLY);
+    if(fd<0) sysErrFatal("failed to open block chain file %s", name.c_str());
+    return fd;
+}
+
+static ssize_t readChunk(
+    int      fd,
+    uint8_t  *buf,
+    size_t   size,
+    uint64_t offset
+)
+{
+    while(1) {
+        ssize_t r = pread(fd, buf, size, offset);
+        if(likely(0<=r)) {
+            gBytesRead += r;
+            return r;
+        }
+        if(EINTR==errno) continue;
+
+        // Some refuse O_DIRECT on read only, or at an unaligned offset after a short read
+        int flags = fcntl(fd, F_GETFL);
+        if(EINVAL==errno && 0<=flags && 0!=(flags & O_DIRECT)) {
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+            continue;
+        }
+        sysErrFatal("failed to read block chain file");
+    }
+}
+
+// Hands out a file's bytes in order, one chunk at a time
+struct ChunkSource
+{
+    virtual ~ChunkSource() {}
+
+    // Next chunk of the file, false past its end. The chunk stays valid until the next call
+    virtual bool next(
+        const uint8_t *&p,
+        size_t        &size
+    ) = 0;
+
+    // Makes the next chunk start at offset (aligned, and past the last chunk), false if the source can't jump
+    virtual bool seek(
+        uint64_t offset
+    )
+    {
+        return false;
+    }
+};
+
+// Reads grow from minSize up to kChunkSize while they stay sequential, and shrink back on every jump
+struct PreadSource:public ChunkSource
+{
+    int      fd;
+    uint64_t offset;
+    uint8_t  *buf;
+    size_t   minSize;
+    size_t   readSize;
+
+    PreadSource(
+        const std::string &name,
+        uint64_t          begin,
+        size_t            _minSize
+    )
+    :   fd(openDirect(name)),
+        offset(begin),
+        buf(allocAligned(kChunkSize)),
+        minSize(_minSize),
+        readSize(_minSize)
+    {
+    }
+
+    virtual ~PreadSource()
+    {
+        close(fd);
+        free(buf);
+    }
+
+    virtual bool next(
+        const uint8_t *&p,
+        size_t        &size
+    )
+    {
+        ssize_t r = readChunk(fd, buf, readSize, offset);
+        if(r<=0) return false;
+
+        p = buf;
+        size = r;
+        offset += r;
+        readSize = std::min(2*readSize, (size_t)kChunkSize);
+        return true;
+    }
+
+    virtual bool seek(
+        uint64_t to
+    )
+    {
+        offset = to;
+        readSize = minSize;
+        return true;
+    }
+};
+
+#if defined(__NR_io_uring_setup)
+
+    // io_uring straight through the system calls: keeps kUringDepth chunk reads in flight
+    struct UringSource:public ChunkSource
+    {
+        int                 fd;
+        int                 ringFd;
+        uint64_t            base;
+        uint64_t            nextSubmit;
+        uint64_t            nextConsume;
+        uint64_t            inFlight;
+
+        uint8_t             *sqRing;
+        uint8_t             *cqRing;
+        size_t              sqRingSize;
+        size_t              cqRingSize;
+        io_uring_sqe        *sqes;
+        size_t              sqesSize;
+        unsigned            *sqTail;
+        unsigned            *sqMask;
+        unsigned            *sqArray;
+        unsigned            *cqHead;
+        unsigned            *cqTail;
+        unsigned            *cqMask;
+        io_uring_cqe        *cqes;
+
+        uint8_t             *bufs;
+        iovec               iovs[kUringDepth];
+        int64_t             results[kUringDepth];
+        bool                done[kUringDepth];
+
+        UringSource(
+            const std::string &name,
+            uint64_t          begin
+        )
+        :   fd(openDirect(name)),
+            ringFd(-1),
+            base(begin),
+            nextSubmit(0),
+            nextConsume(0),
+            inFlight(0),
+            sqRing((uint8_t*)MAP_FAILED),
+            cqRing((uint8_t*)MAP_FAILED),
+            sqes((io_uring_sqe*)MAP_FAILED),
+            bufs(0)
+        {
+        }
+
+        // False when the kernel won't give us a ring (too old, or locked down)
+        bool init()
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ringFd = syscall(__NR_io_uring_setup, kUringDepth, &params);
+            if(ringFd<0) return false;
+
+            sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+
+            bool single = (0!=(params.features & IORING_FEAT_SINGLE_MMAP));
+            if(single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+            int prot = PROT_READ | PROT_WRITE;
+            int flags = MAP_SHARED | MAP_POPULATE;
+            sqRing = (uint8_t*)mmap(0, sqRingSize, prot, flags, ringFd, IORING_OFF_SQ_RING);
+            if(MAP_FAILED==(void*)sqRing) return false;
+
+            cqRing = single ? sqRing : (uint8_t*)mmap(0, cqRingSize, prot, flags, ringFd, IORING_OFF_CQ_RING);
+            if(MAP_FAILED==(void*)cqRing) return false;
+
+            sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe*)mmap(0, sqesSize, prot, flags, ringFd, IORING_OFF_SQES);
+            if(MAP_FAILED==(void*)sqes) return false;
+
+            sqTail = (unsigned*)(sqRing + params.sq_off.tail);
+            sqMask = (unsigned*)(sqRing + params.sq_off.ring_mask);
+            sqArray = (unsigned*)(sqRing + params.sq_off.array);
+            cqHead = (unsigned*)(cqRing + params.cq_off.head);
+            cqTail = (unsigned*)(cqRing + params.cq_off.tail);
+            cqMask = (unsigned*)(cqRing + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cqRing + params.cq_off.cqes);
+
+            bufs = allocAligned(kUringDepth*(size_t)kChunkSize);
+            for(int i=0; i<kUringDepth; ++i) {
+                iovs[i].iov_base = bufs + i*(size_t)kChunkSize;
+                iovs[i].iov_len = kChunkSize;
+                done[i] = false;
+            }
+
+            for(int i=0; i<kUringDepth; ++i) queue();
+            return 0<=enter(kUringDepth, 0);
+        }
+
+        virtual ~UringSource()
+        {
+            while(0<inFlight && 0<=enter(0, 1)) reap();
+
+            if(MAP_FAILED!=(void*)sqes) munmap(sqes, sqesSize);
+            if(MAP_FAILED!=(void*)cqRing && cqRing!=sqRing) munmap(cqRing, cqRingSize);
+            if(MAP_FAILED!=(void*)sqRing) munmap(sqRing, sqRingSize);
+            if(0<=ringFd) close(ringFd);
+            close(fd);
+            free(bufs);
+        }
+
+        int enter(
+            unsigned toSubmit,
+            unsigned minComplete
+        )
+        {
+            while(1) {
+                unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+                int r = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, 0, 0);
+                if(likely(0<=r) || EINTR!=errno) return r;
+            }
+        }
+
+        // Puts the read of the next chunk in the submission ring, the caller then has to enter()
+        void queue()
+        {
+            uint64_t chunk = nextSubmit++;
+            size_t slot = chunk % kUringDepth;
+            done[slot] = false;
+
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            io_uring_sqe *sqe = sqes + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)(iovs + slot);
+            sqe->len = 1;
+            sqe->off = base + chunk*kChunkSize;
+            sqe->user_data = chunk;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++inFlight;
+        }
+
+        void reap()
+        {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while(head!=tail) {
+                const io_uring_cqe *cqe = cqes + (head & *cqMask);
+                size_t slot = cqe->user_data % kUringDepth;
+                results[slot] = cqe->res;
+                if(0<cqe->res) gBytesRead += cqe->res;
+                done[slot] = true;
+                --inFlight;
+                ++head;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        virtual bool next(
+            const uint8_t *&p,
+            size_t        &size
+        )
+        {
+            // The chunk handed out last time is free again: reuse its buffer for the next read
+            if(0<nextConsume) {
+                queue();
+                if(enter(1, 0)<0) sysErrFatal("io_uring submission failed");
+            }
+
+            uint64_t chunk = nextConsume++;
+            size_t slot = chunk % kUringDepth;
+            while(1) {
+                reap();
+                if(done[slot]) break;
+                if(enter(0, 1)<0) sysErrFatal("io_uring wait failed");
+            }
+
+            // Reads the kernel refused (e.g. O_DIRECT on an odd file system) get redone synchronously
+            uint8_t *buf = bufs + slot*(size_t)kChunkSize;
+            int64_t r = results[slot];
+            if(r<0) r = readChunk(fd, buf, kChunkSize, base + chunk*kChunkSize);
+            while(0<r && r<kChunkSize) {
+                ssize_t more = readChunk(fd, buf + r, kChunkSize - r, base + chunk*kChunkSize + r);
+                if(more<=0) break;
+                r += more;
+            }
+            if(r<=0) return false;
+
+            p = buf;
+            size = r;
+            return true;
+        }
+    };
+
+#endif
+
+static ChunkSource *newChunkSource(
+    const std::string &name,
+    uint64_t          begin
+)
+{
+    int backend = getIOBackend();
+
+    #if defined(__NR_io_uring_setup)
+        if(kIOUring==backend) {
+            UringSource *source = new UringSource(name, begin);
+            if(source->init()) return source;
+            delete source;
+
+            static bool warned = false;
+            if(!warned) warning("io_uring isn't available, using pread instead");
+            warned = true;
+        }
+    #endif
+
+    return new PreadSource(name, begin, kIOHeaders==backend ? kProbeSize : kChunkSize);
+}
+
+FileStream::FileStream(
+    const std::string &name,
+    const uint8_t     *_map,
+    uint64_t          begin,
+    uint64_t          _end
+)
+:   map(_map),
+    end(_end),
+    advised(0),
+    source(0),
+    winStart(begin & ~(uint64_t)(kAlign - 1)),
+    winEnd(winStart)
+{
+    if(kIOMmap!=getIOBackend()) source = newChunkSource(name, winStart);
+}
+
+FileStream::~FileStream()
+{
+    delete source;
+}
+
+void FileStream::advise(
+    uint64_t offset
+)
+{
+    uint64_t from = offset & ~(uint64_t)(kAlign - 1);
+    uint64_t to = std::min(end, from + kAdviseAhead);
+    madvise((void*)(map + from), to - from, MADV_WILLNEED);
+    advised = to;
+}
+
+bool FileStream::pull(
+    uint64_t keep
+)
+{
+    // Bytes between the window and keep aren't needed: skip their read altogether if the source can
+    uint64_t to = keep & ~(uint64_t)(kAlign - 1);
+    if(winEnd<to && source->seek(to)) {
+        window.clear();
+        winStart = winEnd = to;
+    }
+
+    // Whatever is before keep won't be asked for again
+    if(winStart<keep) {
+        uint64_t drop = std::min(keep, winEnd) - winStart;
+        window.erase(window.begin(), window.begin() + drop);
+        winStart += drop;
+    }
+
+    const uint8_t *p;
+    size_t size;
+    if(!source->next(p, size)) return false;
+
+    uint64_t chunkStart = winEnd;
+    if(end<=chunkStart) return false;
+    if(end<(chunkStart + size)) size = end - chunkStart;
+
+    uint64_t skip = 0;
+    if(winStart==winEnd && chunkStart<keep) {
+        skip = std::min((uint64_t)size, keep - chunkStart);
+        winStart = chunkStart + skip;
+    }
+
+    window.insert(window.end(), p + skip, p + size);
+    winEnd = chunkStart + size;
+    return true;
+}
+
@@ -0,0 +1,73 @@
+#ifndef __IO_H__
+    #define __IO_H__
+
+    #include <string>
+    #include <vector>
+    #include <common.h>
+
+    // How block chain files get pulled off the disk, picked with the IO environment variable
+    enum IOBackend
+    {
+        kIOMmap,        // page faults on the mapping, with madvise hints ahead of the reader
+        kIOPread,       // large aligned O_DIRECT preads into a buffer, bypassing the page cache
+        kIOUring,       // same, with several reads in flight through io_uring
+        kIOHeaders,     // small O_DIRECT preads of each block's framing and header, jumping over block bodies
+        kNbIOBackends
+    };
+
+    int getIOBackend();
+    const char *ioBackendName(int backend);
+    uint64_t getIOBytesRead();      // by all streams so far, mmap faults excepted
+
+    struct ChunkSource;
+
+    // Reads bytes [begin, end) of a file front to back. at() hands out a pointer to n contiguous
+    // bytes at offset, which must never go backwards. The pointer stays valid until the next call.
+    // With the mmap backend it points into the mapping, otherwise into a window over the chunks read.
+    struct FileStream
+    {
+        const uint8_t        *map;
+        uint64_t             end;
+        uint64_t             advised;
+        ChunkSource          *source;
+        std::vector<uint8_t> window;
+        uint64_t             winStart;
+        uint64_t             winEnd;
+
+        FileStream(
+            const std::string &name,
+            const uint8_t     *map,         // whole file, mapped
+            uint64_t          begin,
+            uint64_t          end
+        );
+        ~FileStream();
+
+        const uint8_t *at(
+            uint64_t offset,
+            size_t   n
+        )
+        {
+            if(unlikely(end<offset + n)) return 0;
+
+            if(0==source) {
+                if(unlikely(advised<offset + n)) advise(offset);
+                return map + offset;
+            }
+
+            while(unlikely(winEnd<offset + n)) {
+                if(!pull(offset)) return 0;
+            }
+            return window.data() + (offset - winStart);
+        }
+
+    private:
+
+        FileStream(const FileStream &);
+        FileStream &operator=(const FileStream &);
+
+        void advise(uint64_t offset);
+        bool pull(uint64_t keep);
+    };
+
+#endif // __IO_H__
+
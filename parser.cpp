@@ -1,90 +1,273 @@
 
+#include <io.h>
 #include <util.h>
+#include <store.h>
+#include <txmap.h>
 #include <common.h>
+#include <addrdict.h>
 #include <errlog.h>
 #include <callback.h>
 
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
+#include <condition_variable>
+#include <emmintrin.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
 #include <iostream>
+#include <typeinfo>
+#include <algorithm>
+#include <type_traits>
 
-#if !defined(O_DIRECT)
-#   define O_DIRECT 0
+static const uint32_t kNetMagic =
+#if defined(LITECOIN)
+    0xdbb6c0fb
+#else
+#if defined(TESTNET)
+    0x0709110b
+#else
+    0xd9b4bef9
 #endif
+#endif
+;
 
 struct Map
 {
     int fd;
     uint64_t size;
+    int64_t mtime;
+    uint64_t scanEnd;
     const uint8_t *p;
     std::string name;
 };
 
-typedef GoogMap<Hash256, const uint8_t*, Hash256Hasher, Hash256Equal>::Map TXMap;
-typedef GoogMap<Hash256,         Block*, Hash256Hasher, Hash256Equal>::Map BlockMap;
+// On-disk block index cache, lets the first pass skip header hashing on restart
+enum { kBlockIndexMagic = 0x3230305844495042ULL }; // "BPIDX002"
 
-static bool gNeedTXHash;
-static Callback *gCallback;
+struct BlockIndexHeader
+{
+    uint64_t magic;
+    uint64_t nbMaps;
+    uint64_t nbBlocks;
+    int64_t  maxBlock;
+    uint64_t maxHeight;
+    uint64_t checksum;      // of the maps and entries that follow
+};
+
+struct BlockIndexMap
+{
+    char     name[256];
+    uint64_t size;
+    int64_t  mtime;
+    uint64_t scanEnd;
+};
+
+struct BlockIndexEntry
+{
+    uint256_t hash;
+    uint64_t  mapIndex;
+    uint64_t  offset;
+    int64_t   height;
+    int64_t   prev;
+};
+
+struct BlockRef
+{
+    uint256_t     hash;
+    const uint8_t *data;
+    uint8_t       header[80];
+};
+
+struct MapScan
+{
+    uint32_t              mapIndex;
+    bool                  indexed;      // blocks came from the chain store index, nothing left to scan
+    const Map             *map;
+    const uint8_t         *end;
+    std::vector<BlockRef> blocks;
+};
+
+// Per blk file sidecar holding the hashes of all transactions found in that file
+enum { kTXHashMagic = 0x3130304448535854ULL }; // "TXHSD001"
+
+struct TXHashHeader
+{
+    uint64_t magic;
+    uint64_t fileSize;
+    uint64_t nbBlocks;
+    uint64_t nbTX;
+    uint64_t checksum;
+};
+
+struct TXHashBlock
+{
+    uint64_t offset;
+    uint64_t merkle;
+    uint64_t firstTX;
+    uint64_t nbTX;
+};
+
+struct TXHashPending
+{
+    uint64_t      offset;
+    uint64_t      merkle;
+    uint64_t      nbTX;
+    const uint8_t *hashes;
+};
+
+struct TXHashFile
+{
+    const TXHashBlock          *blocks;
+    const uint8_t              *hashes;
+    uint64_t                   nbBlocks;
+    uint64_t                   nbLeft;      // blocks of the longest chain in this file still to be parsed
+    std::vector<TXHashPending> pending;
+};
+
+// Bitcoin Core undo file (rev*.dat): spent coins of each input of each block in the matching blk file
+struct UndoRecord
+{
+    const uint8_t *data;
+    uint64_t size;
+    bool used;
+};
+
+struct UndoMap
+{
+    int fd;
+    uint64_t size;
+    const uint8_t *p;
+    std::string name;
+    bool scanned;
+    size_t cursor;
+    std::vector<UndoRecord> records;
+};
 
-static const Map *gCurMap;
+// Staging area for the block handed to Callback::processBlock, one per parsing thread
+struct BatchArrays
+{
+    const uint8_t                     *base;
+    std::vector<uint32_t>             txInputs;
+    std::vector<uint32_t>             txOutputs;
+    std::vector<uint64_t>             outputValues;
+    std::vector<uint32_t>             outputScriptOffsets;
+    std::vector<uint32_t>             outputScriptSizes;
+    std::vector<const uint8_t*>       inputUpTXHashes;
+    std::vector<uint32_t>             inputUpIndices;
+    std::vector<uint32_t>             inputScriptOffsets;
+    std::vector<uint32_t>             inputScriptSizes;
+    std::vector<uint64_t>             inputValues;
+    std::vector<const uint8_t*>       inputUpScripts;
+    std::vector<uint32_t>             inputUpScriptSizes;
+    std::deque<std::array<uint8_t, 67>> undoScripts;   // scripts rebuilt from undo data, must outlive the block
+};
+
+typedef GoogMap<Hash256, Block*, Hash256Hasher, Hash256Equal>::Map BlockMap;
+
+static bool gUseUndo;
+static bool gNeedTXMap;
+static bool gNeedTXHash;
+static bool gNeedScriptInfo;
+static AddrDict *gAddrDict;
+static thread_local Callback *gCallback;
+static uint32_t gNeeds;
+static void (*gTXLoop)(const uint8_t *p, const uint8_t *txHashes, uint64_t nbTX);
+
+static thread_local const Map *gCurMap;
+static thread_local BatchArrays gBatch;
 static std::vector<Map> mapVec;
+static StoreIndex gStoreIndex;
+static std::vector<TXHashFile> gTXHashFiles;
+static std::vector<UndoMap> gUndoMaps;
+static std::vector<uint8_t> gUndoBuf;
+static const uint8_t *gUndo;
 
 static TXMap gTXMap;
+static std::vector<uint32_t> gOutputOffsets;
+static std::vector<ScriptInfo> gOutputScripts;
+static std::vector<const uint8_t*> gPrevouts;
+static size_t gPrevoutIndex;
 static BlockMap gBlockMap;
-static uint8_t empty[kSHA256ByteSize] = { 0x42 };
+static uint8_t gEmptyKey[kSHA256ByteSize] = { 0x42 };
 
+static bool gBlockIndexStale;
+static bool gBlockIndexRelink;
 static Block *gMaxBlock;
 static Block *gNullBlock;
 static uint64_t gChainSize;
+static uint64_t gChainTXCount;
 static uint64_t gMaxHeight;
 static uint256_t gNullHash;
 
-#define DO(x) x
-    static inline void   startBlock(const uint8_t *p)                      { DO(gCallback->startBlock(p));    }
-    static inline void     endBlock(const uint8_t *p)                      { DO(gCallback->endBlock(p));      }
-    static inline void      startTX(const uint8_t *p, const uint8_t *hash) { DO(gCallback->startTX(p, hash)); }
-    static inline void        endTX(const uint8_t *p)                      { DO(gCallback->endTX(p));         }
-    static inline void  startInputs(const uint8_t *p)                      { DO(gCallback->startInputs(p));   }
-    static inline void    endInputs(const uint8_t *p)                      { DO(gCallback->endInputs(p));     }
-    static inline void   startInput(const uint8_t *p)                      { DO(gCallback->startInput(p));    }
-    static inline void     endInput(const uint8_t *p)                      { DO(gCallback->endInput(p));      }
-    static inline void startOutputs(const uint8_t *p)                      { DO(gCallback->startOutputs(p));  }
-    static inline void   endOutputs(const uint8_t *p)                      { DO(gCallback->endOutputs(p));    }
-    static inline void  startOutput(const uint8_t *p)                      { DO(gCallback->startOutput(p));   }
-    static inline void        start(const Block *s, const Block *e)        { DO(gCallback->start(s, e));      }
-#undef DO
+static inline const uint8_t *locateTX(
+    uint64_t loc
+)
+{
+    return mapVec[TXMap::locMap(loc)].p + TXMap::locOffset(loc);
+}
+
+// Event delivery: a virtual call for the generic parse loop, a direct (inlinable) one when the
+// loop is instantiated over the concrete type of the callback (see DEVIRT in the Makefile)
+#define DO(f, args) (                                                    \
+    std::is_same<CB, Callback>::value ? (gCallback->f args)              \
+                                      : (static_cast<CB*>(gCallback)->CB::f args) \
+)
+    template<typename CB> static inline void      startTX(const uint8_t *p, const uint8_t *hash) { DO(startTX, (p, hash)); }
+    template<typename CB> static inline void        endTX(const uint8_t *p)                      { DO(endTX, (p));         }
+    template<typename CB> static inline void  startInputs(const uint8_t *p)                      { DO(startInputs, (p));   }
+    template<typename CB> static inline void    endInputs(const uint8_t *p)                      { DO(endInputs, (p));     }
+    template<typename CB> static inline void   startInput(const uint8_t *p)                      { DO(startInput, (p));    }
+    template<typename CB> static inline void     endInput(const uint8_t *p)                      { DO(endInput, (p));      }
+    template<typename CB> static inline void startOutputs(const uint8_t *p)                      { DO(startOutputs, (p));  }
+    template<typename CB> static inline void   endOutputs(const uint8_t *p)                      { DO(endOutputs, (p));    }
+    template<typename CB> static inline void  startOutput(const uint8_t *p)                      { DO(startOutput, (p));   }
+
+static inline void   startBlock(const uint8_t *p)                      { gCallback->startBlock(p);        }
+static inline void     endBlock(const uint8_t *p)                      { gCallback->endBlock(p);          }
+static inline void        start(const Block *s, const Block *e)        { gCallback->start(s, e);          }
 
 static inline void     startMap(const uint8_t *p) { gCallback->startMap(p);               }
 static inline void       endMap(const uint8_t *p) { gCallback->endMap(p);                 }
 static inline void  startBlock(const Block *b)    { gCallback->startBlock(b, gChainSize); }
 static inline void       endBlock(const Block *b) { gCallback->endBlock(b);               }
 
+template<typename CB>
 static inline void endOutput(
     const uint8_t *p,
     uint64_t      value,
     const uint8_t *txHash,
     uint64_t      outputIndex,
     const uint8_t *outputScript,
-    uint64_t      outputScriptSize
+    uint64_t      outputScriptSize,
+    const ScriptInfo *info
 )
 {
-    gCallback->endOutput(
-        p,
-        value,
-        txHash,
-        outputIndex,
-        outputScript,
-        outputScriptSize
+    DO(
+        endOutput,
+        (
+            p,
+            value,
+            txHash,
+            outputIndex,
+            outputScript,
+            outputScriptSize,
+            info
+        )
     );
 }
 
+template<typename CB>
 static inline void edge(
     uint64_t      value,
     const uint8_t *upTXHash,
@@ -94,27 +277,116 @@ static inline void edge(
     const uint8_t *downTXHash,
     uint64_t      inputIndex,
     const uint8_t *inputScript,
-    uint64_t      inputScriptSize
-)
-{
-    gCallback->edge(
-        value,
-        upTXHash,
-        outputIndex,
-        outputScript,
-        outputScriptSize,
-        downTXHash,
-        inputIndex,
-        inputScript,
-        inputScriptSize
+    uint64_t      inputScriptSize,
+    const ScriptInfo *info
+)
+{
+    DO(
+        edge,
+        (
+            value,
+            upTXHash,
+            outputIndex,
+            outputScript,
+            outputScriptSize,
+            downTXHash,
+            inputIndex,
+            inputScript,
+            inputScriptSize,
+            info
+        )
     );
 }
+#undef DO
+
+#define NEEDS(x) (0!=(needs & (x)))
+#define RESOLVE   NEEDS(kNeedEdges | kNeedBatchEdges)
+
+// Records what an input spends, when the batch wants it
+template<uint32_t needs>
+static inline void batchSpent(
+    uint64_t      value,
+    const uint8_t *outputScript,
+    uint64_t      outputScriptSize
+)
+{
+    if(NEEDS(kNeedBatch) && RESOLVE) {
+        gBatch.inputValues.push_back(value);
+        gBatch.inputUpScripts.push_back(outputScript);
+        gBatch.inputUpScriptSizes.push_back(outputScriptSize);
+    }
+}
+
+// Solves an output script once for every command that wants it, 0 if none does
+static inline const ScriptInfo *solveScript(
+    ScriptInfo    &info,
+    const uint8_t *outputScript,
+    uint64_t      outputScriptSize
+)
+{
+    if(!gNeedScriptInfo) return 0;
+    info.type = solveOutputScript(info.hash160, outputScript, outputScriptSize, info.addrType);
+    info.addrId = (gAddrDict && 0<=info.type) ? gAddrDict->add(info.hash160) : AddrDict::kNone;
+    return &info;
+}
+
+// Solved scripts of a new TX go into the TX map, its spends get them back from there
+#define KEEP_SCRIPTS (RESOLVE && gNeedTXMap && gNeedScriptInfo)
+
+// All output scripts of a TX solved in one go, so that the pubKeys which aren't cached get hashed together
+static thread_local std::vector<ScriptInfo> gSolved;
+static thread_local std::vector<const uint8_t*> gSolveScripts;
+static thread_local std::vector<uint64_t> gSolveSizes;
+static thread_local std::vector<uint8_t> gSolveHashes;
+static thread_local std::vector<int> gSolveResults;
+static thread_local std::vector<uint8_t> gSolveTypes;
+
+static const ScriptInfo *solveScripts(
+    const uint8_t *p,                   // first output
+    uint64_t      nbOutputs
+)
+{
+    gSolveScripts.resize(nbOutputs);
+    gSolveSizes.resize(nbOutputs);
+    for(uint64_t i=0; i<nbOutputs; ++i) {
+        SKIP(uint64_t, value, p);
+        LOAD_VARINT(outputScriptSize, p);
+        gSolveScripts[i] = p;
+        gSolveSizes[i] = outputScriptSize;
+        p += outputScriptSize;
+    }
+
+    gSolveHashes.resize(nbOutputs*kRIPEMD160ByteSize);
+    gSolveResults.resize(nbOutputs);
+    gSolveTypes.resize(2*nbOutputs);
+    solveOutputScripts(
+        gSolveHashes.data(),
+        gSolveResults.data(),
+        gSolveTypes.data(),
+        gSolveScripts.data(),
+        gSolveSizes.data(),
+        nbOutputs
+    );
+
+    gSolved.resize(nbOutputs);
+    for(uint64_t i=0; i<nbOutputs; ++i) {
+        ScriptInfo &info = gSolved[i];
+        info.type = gSolveResults[i];
+        info.addrType[0] = gSolveTypes[2*i + 0];
+        info.addrType[1] = gSolveTypes[2*i + 1];
+        info.addrType[2] = 0;
+        memcpy(info.hash160, &gSolveHashes[i*kRIPEMD160ByteSize], kRIPEMD160ByteSize);
+        info.addrId = (gAddrDict && 0<=info.type) ? gAddrDict->add(info.hash160) : AddrDict::kNone;
+    }
+    return gSolved.data();
+}
 
 template<
-    bool skip,
-    bool fullContext
+    typename CB,
+    uint32_t needs,
+    bool     fullContext
 >
-static void parseOutput(
+static bool parseOutput(
     const uint8_t *&p,
     const uint8_t *txHash,
     uint64_t      outputIndex,
@@ -122,10 +394,11 @@ static void parseOutput(
     uint64_t      downInputIndex,
     const uint8_t *downInputScript,
     uint64_t      downInputScriptSize,
-    bool          found = false
+    bool          found = false,
+    const ScriptInfo *upScript = 0
 )
 {
-    if(!skip && !fullContext) startOutput(p);
+    if(NEEDS(kNeedOutputEvents) && !fullContext) startOutput<CB>(p);
 
         LOAD(uint64_t, value, p);
         LOAD_VARINT(outputScriptSize, p);
@@ -133,8 +406,24 @@ static void parseOutput(
         const uint8_t *outputScript = p;
         p += outputScriptSize;
 
-        if(!skip && fullContext && found) {
-            edge(
+        if(NEEDS(kNeedBatch) && !fullContext) {
+            gBatch.outputValues.push_back(value);
+            gBatch.outputScriptOffsets.push_back(outputScript - gBatch.base);
+            gBatch.outputScriptSizes.push_back(outputScriptSize);
+        }
+
+        if(fullContext && found) batchSpent<needs>(value, outputScript, outputScriptSize);
+
+        ScriptInfo info;
+        const ScriptInfo *scriptInfo = upScript;
+        if(0==scriptInfo) {
+            bool wanted = fullContext ? (NEEDS(kNeedEdges) && found) : (NEEDS(kNeedOutputEvents) || KEEP_SCRIPTS);
+            if(wanted) scriptInfo = solveScript(info, outputScript, outputScriptSize);
+        }
+        if(KEEP_SCRIPTS && !fullContext) gOutputScripts.push_back(*scriptInfo);
+
+        if(NEEDS(kNeedEdges) && fullContext && found) {
+            edge<CB>(
                 value,
                 txHash,
                 outputIndex,
@@ -143,42 +432,63 @@ static void parseOutput(
                 downTXHash,
                 downInputIndex,
                 downInputScript,
-                downInputScriptSize
+                downInputScriptSize,
+                scriptInfo
             );
         }
 
-    if(!skip && !fullContext) {
-        endOutput(
+    if(NEEDS(kNeedOutputEvents) && !fullContext) {
+        endOutput<CB>(
             p,
             value,
             txHash,
             outputIndex,
             outputScript,
-            outputScriptSize
+            outputScriptSize,
+            scriptInfo
         );
     }
+
+    // Outputs starting with OP_RETURN can never be spent
+    return (0==outputScriptSize || 0x6A!=outputScript[0]);
 }
 
 template<
-    bool skip,
-    bool fullContext
+    typename CB,
+    uint32_t needs,
+    bool     fullContext
 >
-static void parseOutputs(
+static uint64_t parseOutputs(
     const uint8_t *&p,
     const uint8_t *txHash,
     uint64_t      stopAtIndex = -1,
     const uint8_t *downTXHash = 0,
     uint64_t      downInputIndex = 0,
     const uint8_t *downInputScript = 0,
-    uint64_t      downInputScriptSize = 0
+    uint64_t      downInputScriptSize = 0,
+    const ScriptInfo *upScript = 0
 )
 {
-    if(!skip && !fullContext) startOutputs(p);
+    if(NEEDS(kNeedOutputEvents) && !fullContext) startOutputs<CB>(p);
 
+        uint64_t nbSpendable = 0;
         LOAD_VARINT(nbOutputs, p);
+
+        bool wantOffsets = (RESOLVE && gNeedTXMap && !fullContext);
+        if(wantOffsets) {
+            gOutputOffsets.clear();
+            wantOffsets = (TXMap::kMinWideOutputs<=nbOutputs);
+        }
+        if(KEEP_SCRIPTS && !fullContext) gOutputScripts.clear();
+
+        const ScriptInfo *solved = 0;
+        bool solve = gNeedScriptInfo && !fullContext && (NEEDS(kNeedOutputEvents) || KEEP_SCRIPTS);
+        if(solve) solved = solveScripts(p, nbOutputs);
+
         for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
-            bool found = fullContext && !skip && (stopAtIndex==outputIndex);
-            parseOutput<skip, fullContext>(
+            if(wantOffsets) gOutputOffsets.push_back(p - gCurMap->p);
+            bool found = fullContext && (stopAtIndex==outputIndex);
+            nbSpendable += parseOutput<CB, needs, fullContext>(
                 p,
                 txHash,
                 outputIndex,
@@ -186,16 +496,125 @@ static void parseOutputs(
                 downInputIndex,
                 downInputScript,
                 downInputScriptSize,
-                found
+                found,
+                solved ? solved + outputIndex : (found ? upScript : 0)
             );
             if(found) break;
         }
 
-    if(!skip && !fullContext) endOutputs(p);
+    if(NEEDS(kNeedOutputEvents) && !fullContext) endOutputs<CB>(p);
+    return nbSpendable;
+}
+
+template<typename CB, uint32_t needs> static void parseInputs(const uint8_t *&p, const uint8_t *txHash);
+
+// Spends of the block being parsed, looked ahead of so TX map buckets and upstream TXs are already
+// in cache when parseInput gets to them. TXs of the block itself only enter the map as they get
+// parsed, so lookups can't all be resolved upfront: this only ever prefetches.
+enum { kPrefetchDistance = 8 };
+
+static void gatherPrevouts(
+    const uint8_t *p,
+    uint64_t      nbTX
+)
+{
+    gPrevouts.clear();
+    gPrevoutIndex = 0;
+
+    for(uint64_t txIndex=0; txIndex<nbTX; ++txIndex) {
+
+        SKIP(uint32_t, version, p);
+
+        LOAD_VARINT(nbInputs, p);
+        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex) {
+            gPrevouts.push_back(p);
+            SKIP(uint256_t, upTXHash, p);
+            SKIP(uint32_t, upOutputIndex, p);
+            LOAD_VARINT(inputScriptSize, p);
+            p += inputScriptSize;
+            SKIP(uint32_t, sequence, p);
+        }
+
+        LOAD_VARINT(nbOutputs, p);
+        for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+            SKIP(uint64_t, value, p);
+            LOAD_VARINT(outputScriptSize, p);
+            p += outputScriptSize;
+        }
+
+        SKIP(uint32_t, lockTime, p);
+    }
+
+    size_t n = std::min(gPrevouts.size(), (size_t)(2*kPrefetchDistance));
+    for(size_t i=0; i<n; ++i) gTXMap.prefetch(gPrevouts[i]);
+}
+
+// Called once per input: buckets get prefetched two strides ahead, the upstream TX one stride ahead
+static inline void prefetchPrevouts()
+{
+    size_t i = gPrevoutIndex++;
+    size_t n = gPrevouts.size();
+    if(likely((i + 2*kPrefetchDistance)<n)) gTXMap.prefetch(gPrevouts[i + 2*kPrefetchDistance]);
+    if(likely((i + kPrefetchDistance)<n)) {
+        const TXMap::Slot *slot = gTXMap.peek(gPrevouts[i + kPrefetchDistance]);
+        if(likely(0!=slot)) {
+            const uint8_t *upTX = locateTX(slot->loc);
+            __builtin_prefetch(upTX);
+            __builtin_prefetch(upTX + 64);
+        }
+    }
 }
 
 template<
-    bool skip
+    typename CB,
+    uint32_t needs
+>
+static void parseUndo(
+    const uint8_t *upTXHash,
+    uint64_t      upOutputIndex,
+    const uint8_t *downTXHash,
+    uint64_t      downInputIndex,
+    const uint8_t *downInputScript,
+    uint64_t      downInputScriptSize
+)
+{
+    // One Coin record per input: VARINT(height*2 + coinbase), legacy TX version
+    // when height is set, then the spent output in compressed form
+    uint64_t code = loadCoreVarInt(gUndo);
+    if(0!=(code>>1)) loadCoreVarInt(gUndo);
+
+    uint64_t value = decompressAmount(loadCoreVarInt(gUndo));
+
+    uint8_t buf[67];
+    uint64_t outputScriptSize;
+    const uint8_t *outputScript = decompressScript(buf, gUndo, outputScriptSize);
+
+    if(NEEDS(kNeedBatch) && outputScript==buf) {
+        gBatch.undoScripts.push_back(std::array<uint8_t, 67>());
+        outputScript = (const uint8_t*)memcpy(gBatch.undoScripts.back().data(), buf, outputScriptSize);
+    }
+    batchSpent<needs>(value, outputScript, outputScriptSize);
+
+    if(NEEDS(kNeedEdges)) {
+        ScriptInfo info;
+        edge<CB>(
+            value,
+            upTXHash,
+            upOutputIndex,
+            outputScript,
+            outputScriptSize,
+            downTXHash,
+            downInputIndex,
+            downInputScript,
+            downInputScriptSize,
+            solveScript(info, outputScript, outputScriptSize)
+        );
+    }
+}
+
+template<
+    typename CB,
+    uint32_t needs
 >
 static void parseInput(
     const uint8_t *&p,
@@ -203,100 +622,613 @@ static void parseInput(
     uint64_t      inputIndex
 )
 {
-    if(!skip) startInput(p);
+    if(NEEDS(kNeedInputEvents)) startInput<CB>(p);
 
         const uint8_t *upTXHash = p;
-        const uint8_t *upTXOutputs = 0;
+        TXMap::Slot *upTXSlot = 0;
 
-        if(gNeedTXHash && !skip) {
-            bool isGenTX = (0==memcmp(gNullHash.v, upTXHash, sizeof(gNullHash)));
-            if(likely(false==isGenTX)) {
-                auto i = gTXMap.find(upTXHash);
-                if(unlikely(gTXMap.end()==i))
-                    errFatal("failed to locate upstream TX");
-                upTXOutputs = i->second;
-            }
+        if(RESOLVE && gNeedTXMap) prefetchPrevouts();
+
+        bool isGenTX = false;
+        if(RESOLVE) isGenTX = (0==memcmp(gNullHash.v, upTXHash, sizeof(gNullHash)));
+
+        if(RESOLVE && gNeedTXMap && likely(false==isGenTX)) {
+            upTXSlot = gTXMap.find(upTXHash);
+            if(unlikely(0==upTXSlot))
+                errFatal("failed to locate upstream TX");
         }
 
         SKIP(uint256_t, dummyUpTXhash, p);
         LOAD(uint32_t, upOutputIndex, p);
         LOAD_VARINT(inputScriptSize, p);
 
-        if(!skip && 0!=upTXOutputs) {
+        if(NEEDS(kNeedBatch)) {
+            gBatch.inputUpTXHashes.push_back(upTXHash);
+            gBatch.inputUpIndices.push_back(upOutputIndex);
+            gBatch.inputScriptOffsets.push_back(p - gBatch.base);
+            gBatch.inputScriptSizes.push_back(inputScriptSize);
+        }
+
+        if(RESOLVE && 0!=upTXSlot) {
+
             const uint8_t *inputScript = p;
-            parseOutputs<false, true>(
-                upTXOutputs,
+            ScriptInfo upInfo;
+            const ScriptInfo *upScript = gTXMap.getScript(upTXSlot, upOutputIndex, upInfo) ? &upInfo : 0;
+            uint64_t upNbOutputs = 0;
+            const uint32_t *upOffsets = gTXMap.getOffsets(upTXSlot, upNbOutputs);
+            if(unlikely(0!=upOffsets)) {
+                if(unlikely(upNbOutputs<=upOutputIndex)) errFatal("failed to locate upstream TX");
+                const uint8_t *upOutput = mapVec[TXMap::locMap(upTXSlot->loc)].p + upOffsets[upOutputIndex];
+                parseOutput<CB, needs & (kNeedEdges | kNeedBatch | kNeedBatchEdges), true>(
+                    upOutput,
+                    upTXHash,
+                    upOutputIndex,
+                    txHash,
+                    inputIndex,
+                    inputScript,
+                    inputScriptSize,
+                    true,
+                    upScript
+                );
+            } else {
+                const uint8_t *upTXOutputs = locateTX(upTXSlot->loc);
+                SKIP(uint32_t, upVersion, upTXOutputs);
+                parseInputs<CB, 0>(upTXOutputs, 0);
+                parseOutputs<CB, needs & (kNeedEdges | kNeedBatch | kNeedBatchEdges), true>(
+                    upTXOutputs,
+                    upTXHash,
+                    upOutputIndex,
+                    txHash,
+                    inputIndex,
+                    inputScript,
+                    inputScriptSize,
+                    upScript
+                );
+            }
+            gTXMap.spend(upTXSlot);
+        }
+
+        if(RESOLVE && gUseUndo && likely(false==isGenTX)) {
+            parseUndo<CB, needs>(
                 upTXHash,
                 upOutputIndex,
                 txHash,
                 inputIndex,
-                inputScript,
+                p,
                 inputScriptSize
             );
         }
 
+        // Coinbases spend nothing
+        if(NEEDS(kNeedBatch) && RESOLVE) {
+            bool unresolved = (gBatch.inputValues.size()<gBatch.inputUpTXHashes.size());
+            if(unresolved) batchSpent<needs>(0, 0, 0);
+        }
+
         p += inputScriptSize;
         SKIP(uint32_t, sequence, p);
 
-    if(!skip) endInput(p);
+    if(NEEDS(kNeedInputEvents)) endInput<CB>(p);
 }
 
 template<
-    bool skip
+    typename CB,
+    uint32_t needs
 >
 static void parseInputs(
     const uint8_t *&p,
     const uint8_t *txHash
 )
 {
-    if(!skip) startInputs(p);
+    if(NEEDS(kNeedInputEvents)) startInputs<CB>(p);
 
         LOAD_VARINT(nbInputs, p);
+
+        if(RESOLVE && gUseUndo) {
+            bool isGenTX = (0==memcmp(gNullHash.v, p, sizeof(gNullHash)));
+            if(likely(false==isGenTX)) {
+                LOAD_VARINT(nbUndo, gUndo);
+                if(unlikely(nbUndo!=nbInputs)) errFatal("undo data doesn't match transaction");
+            }
+        }
+
         for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex)
-            parseInput<skip>(p, txHash, inputIndex);
+            parseInput<CB, needs>(p, txHash, inputIndex);
 
-    if(!skip) endInputs(p);
+    if(NEEDS(kNeedInputEvents)) endInputs<CB>(p);
 }
 
 template<
-    bool skip
+    typename CB,
+    uint32_t needs
 >
 static void parseTX(
-    const uint8_t *&p
+    const uint8_t *&p,
+    const uint8_t *txHash = 0
 )
 {
-    uint8_t *txHash = 0;
     const uint8_t *txStart = p;
+    if(NEEDS(kNeedTXEvents)) startTX<CB>(p, txHash);
 
-    if(gNeedTXHash && !skip) {
-        const uint8_t *txEnd = p;
-        parseTX<true>(txEnd);
-        txHash = allocHash256();
-        sha256Twice(txHash, txStart, txEnd - txStart);
-    }
-
-    if(!skip) startTX(p, txHash);
+        if(NEEDS(kNeedBatch)) {
+            gBatch.txInputs.push_back(gBatch.inputUpTXHashes.size());
+            gBatch.txOutputs.push_back(gBatch.outputValues.size());
+        }
 
         SKIP(uint32_t, version, p);
 
-        parseInputs<skip>(p, txHash);
+        parseInputs<CB, needs>(p, txHash);
 
-        if(gNeedTXHash && !skip)
-            gTXMap[txHash] = p;
+        uint64_t nbSpendable = parseOutputs<CB, needs, false>(p, txHash);
 
-        parseOutputs<skip, false>(p, txHash);
+        if(RESOLVE && gNeedTXMap) {
+            uint64_t offset = txStart - gCurMap->p;
+            uint64_t mapIndex = gCurMap - &mapVec[0];
+            gTXMap.insert(txHash, TXMap::makeLoc(mapIndex, offset), nbSpendable, gOutputOffsets, gOutputScripts);
+        }
 
         SKIP(uint32_t, lockTime, p);
 
-    if(!skip) endTX(p);
+    if(NEEDS(kNeedTXEvents)) endTX<CB>(p);
 }
 
-static void parseBlock(
+static bool verifyTX(
+    uint64_t      loc,
+    const uint8_t *hash
+)
+{
+    const uint8_t *p = locateTX(loc);
+    const uint8_t *txStart = p;
+    parseTX<Callback, 0>(p);
+
+    uint256_t txHash;
+    sha256Twice(txHash.v, txStart, p - txStart);
+    return 0==memcmp(txHash.v, hash, kSHA256ByteSize);
+}
+
+// blk file names repeat across datadirs (mainnet and testnet both have blk00000.dat): keyed on the datadir
+static std::string txHashFileName(
+    const Map &map
+)
+{
+    const std::string &cacheDir = getSourceCacheDir();
+    if(0==cacheDir.size()) return cacheDir;
+
+    size_t slash = map.name.rfind('/');
+    std::string baseName = (std::string::npos==slash) ? map.name : map.name.substr(1+slash);
+    return cacheDir + baseName + ".txids";
+}
+
+static void loadTXHashes()
+{
+    gTXHashFiles.resize(mapVec.size());
+    for(size_t i=0; i<mapVec.size(); ++i) {
+
+        const Map &map = mapVec[i];
+        TXHashFile &txHashFile = gTXHashFiles[i];
+        txHashFile.nbBlocks = 0;
+        txHashFile.nbLeft = 0;
+
+        std::string fileName = txHashFileName(map);
+        if(0==fileName.size()) continue;
+
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if(fd<0) continue;
+
+        struct stat statBuf;
+        int r = fstat(fd, &statBuf);
+        if(r<0 || statBuf.st_size<(off_t)sizeof(TXHashHeader)) {
+            close(fd);
+            continue;
+        }
+
+        size_t size = statBuf.st_size;
+        void *pMap = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(((void*)-1)==pMap) {
+            sysErr("failed to mmap TX hash file %s", fileName.c_str());
+            continue;
+        }
+
+        const uint8_t *p = (const uint8_t*)pMap;
+        const TXHashHeader *header = (const TXHashHeader*)p;
+        const TXHashBlock *blocks = (const TXHashBlock*)(header + 1);
+        const uint8_t *hashes = (const uint8_t*)(blocks + header->nbBlocks);
+
+        size_t payloadSize = header->nbBlocks*sizeof(TXHashBlock) + header->nbTX*kSHA256ByteSize;
+        bool ok = (
+            kTXHashMagic==header->magic                     &&
+            header->fileSize<=map.size                      &&
+            size==(sizeof(TXHashHeader) + payloadSize)      &&
+            header->checksum==checksum64(blocks, payloadSize)
+        );
+
+        if(!ok) {
+            warning("TX hash file %s is damaged or stale, ignoring it", fileName.c_str());
+            munmap(pMap, size);
+            continue;
+        }
+
+        txHashFile.blocks = blocks;
+        txHashFile.hashes = hashes;
+        txHashFile.nbBlocks = header->nbBlocks;
+    }
+
+    // A file's sidecar gets written as soon as its last block is parsed, see doneTXHashes
+    const Block *block = gNullBlock->next;
+    while(likely(0!=block)) {
+        ++gTXHashFiles[block->mapIndex].nbLeft;
+        block = block->next;
+    }
+}
+
+static void saveTXHashFile(
+    size_t i
+)
+{
+    TXHashFile &txHashFile = gTXHashFiles[i];
+    if(0==txHashFile.pending.size()) return;
+
+    const Map &map = mapVec[i];
+    std::string fileName = txHashFileName(map);
+
+    // Merge what was already on disk with the blocks hashed during this run
+    std::vector<TXHashPending> all;
+    for(uint64_t j=0; j<txHashFile.nbBlocks; ++j) {
+        const TXHashBlock &block = txHashFile.blocks[j];
+        TXHashPending entry;
+        entry.offset = block.offset;
+        entry.merkle = block.merkle;
+        entry.nbTX = block.nbTX;
+        entry.hashes = txHashFile.hashes + block.firstTX*kSHA256ByteSize;
+        all.push_back(entry);
+    }
+
+    // Callbacks may still hold on to the hashes computed this run (map keys, edges), they only get copied here
+    std::vector<TXHashPending> pending;
+    pending.swap(txHashFile.pending);
+
+    all.insert(all.begin(), pending.begin(), pending.end());
+    std::stable_sort(
+        all.begin(),
+        all.end(),
+        [](const TXHashPending &a, const TXHashPending &b) { return a.offset<b.offset; }
+    );
+    all.erase(
+        std::unique(
+            all.begin(),
+            all.end(),
+            [](const TXHashPending &a, const TXHashPending &b) { return a.offset==b.offset; }
+        ),
+        all.end()
+    );
+
+    uint64_t nbTX = 0;
+    std::vector<TXHashBlock> blocks(all.size());
+    for(size_t j=0; j<all.size(); ++j) {
+        blocks[j].offset = all[j].offset;
+        blocks[j].merkle = all[j].merkle;
+        blocks[j].firstTX = nbTX;
+        blocks[j].nbTX = all[j].nbTX;
+        nbTX += all[j].nbTX;
+    }
+
+    std::vector<uint8_t> payload(blocks.size()*sizeof(TXHashBlock) + nbTX*kSHA256ByteSize);
+    uint8_t *dst = &payload[0];
+    memcpy(dst, &blocks[0], blocks.size()*sizeof(TXHashBlock));
+    dst += blocks.size()*sizeof(TXHashBlock);
+    for(size_t j=0; j<all.size(); ++j) {
+        size_t n = all[j].nbTX*kSHA256ByteSize;
+        memcpy(dst, all[j].hashes, n);
+        dst += n;
+    }
+
+    TXHashHeader header;
+    header.magic = kTXHashMagic;
+    header.fileSize = map.size;
+    header.nbBlocks = blocks.size();
+    header.nbTX = nbTX;
+    header.checksum = checksum64(&payload[0], payload.size());
+
+    std::string tmpName = fileName + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) {
+        warning("couldn't open %s for writing (%s)", tmpName.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = (
+        1==fwrite(&header, sizeof(header), 1, f)    &&
+        1==fwrite(&payload[0], payload.size(), 1, f)
+    );
+    ok = (0==fclose(f)) && ok;
+    if(ok) ok = (0==rename(tmpName.c_str(), fileName.c_str()));
+    if(!ok) {
+        warning("failed to write TX hash file %s (%s)", fileName.c_str(), strerror(errno));
+        unlink(tmpName.c_str());
+    }
+}
+
+// Runs at exit, for the files whose blocks weren't all parsed (e.g. a callback bailing out early)
+static void saveTXHashes()
+{
+    for(size_t i=0; i<gTXHashFiles.size(); ++i) saveTXHashFile(i);
+}
+
+template<
+    typename CB,
+    uint32_t needs
+>
+static void parseTXs(
+    const uint8_t *p,
+    const uint8_t *txHashes,
+    uint64_t      nbTX
+)
+{
+    if(RESOLVE && gNeedTXMap) gatherPrevouts(p, nbTX);
+
+    for(uint64_t txIndex=0; likely(txIndex<nbTX); ++txIndex) {
+        const uint8_t *txHash = txHashes ? (txHashes + txIndex*kSHA256ByteSize) : 0;
+        parseTX<CB, needs>(p, txHash);
+        if(NEEDS(kNeedCoinbaseOnly)) break;
+    }
+}
+
+// One parse loop per combination of needs, dead event calls and lookups compiled out
+typedef void (*TXLoop)(const uint8_t *p, const uint8_t *txHashes, uint64_t nbTX);
+
+template<typename CB> struct TXLoops { static const TXLoop loops[128]; };
+
+#define L1(n)  parseTXs<CB, n>
+#define L2(n)  L1(n), L1(n + 1)
+#define L4(n)  L2(n), L2(n + 2)
+#define L8(n)  L4(n), L4(n + 4)
+#define L16(n) L8(n), L8(n + 8)
+#define L64(n) L16(n), L16(n + 16), L16(n + 32), L16(n + 48)
+    template<typename CB> const TXLoop TXLoops<CB>::loops[128] = { L64(0), L64(64) };
+#undef L64
+#undef L16
+#undef L8
+#undef L4
+#undef L2
+#undef L1
+
+// Sidecar lookup, returns 0 when the block's TX hashes aren't in there
+static const uint8_t *findTXHashes(
+    const Block *block,
+    uint64_t    nbTX
+)
+{
+    const Map &map = mapVec[block->mapIndex];
+    const TXHashFile &txHashFile = gTXHashFiles[block->mapIndex];
+
+    uint64_t offset = block->data - map.p;
+    uint64_t merkle = *(const uint64_t*)(4 + kSHA256ByteSize + block->data);
+
+    const TXHashBlock *s = txHashFile.blocks;
+    const TXHashBlock *e = txHashFile.nbBlocks + s;
+    const TXHashBlock *i = std::lower_bound(
+        s,
+        e,
+        offset,
+        [](const TXHashBlock &b, uint64_t o) { return b.offset<o; }
+    );
+
+    bool found = (
+        i!=e                &&
+        offset==i->offset   &&
+        merkle==i->merkle   &&
+        nbTX==i->nbTX
+    );
+    return likely(found) ? (txHashFile.hashes + i->firstTX*kSHA256ByteSize) : 0;
+}
+
+// TX hashes computed this run: callbacks keep pointers into them (map keys, edges), so they live until
+// exit, carved out of large chunks like allocHash256 does. Hash workers allocate too, hence the lock.
+static std::mutex gTXHashPoolMutex;
+static uint8_t *gTXHashPool;
+static uint64_t gTXHashPoolLeft;
+static const uint64_t kTXHashPoolSize = 16ULL<<20;
+
+static uint8_t *allocTXHashes(
+    uint64_t nbTX
+)
+{
+    uint64_t size = nbTX*kSHA256ByteSize;
+    std::lock_guard<std::mutex> lock(gTXHashPoolMutex);
+    if(unlikely(gTXHashPoolLeft<size)) {
+        uint64_t poolSize = std::max(size, kTXHashPoolSize);
+        gTXHashPool = (uint8_t*)malloc(poolSize);
+        if(0==gTXHashPool) sysErrFatal("failed to allocate %" PRIu64 " bytes for TX hashes", poolSize);
+        gTXHashPoolLeft = poolSize;
+    }
+
+    uint8_t *hashes = gTXHashPool;
+    gTXHashPool += size;
+    gTXHashPoolLeft -= size;
+    return hashes;
+}
+
+static uint8_t *hashTXs(
+    const uint8_t *p,
+    uint64_t      nbTX
+)
+{
+    uint8_t *hashes = allocTXHashes(nbTX);
+
+    // Delimit all TXs first, so that they can be hashed several at a time
+    std::vector<uint8_t*> results(nbTX);
+    std::vector<const uint8_t*> starts(nbTX);
+    std::vector<size_t> sizes(nbTX);
+    for(uint64_t txIndex=0; txIndex<nbTX; ++txIndex) {
+        starts[txIndex] = p;
+        parseTX<Callback, 0>(p);
+        sizes[txIndex] = p - starts[txIndex];
+        results[txIndex] = hashes + txIndex*kSHA256ByteSize;
+    }
+
+    sha256TwiceMany(results.data(), starts.data(), sizes.data(), nbTX);
+    return hashes;
+}
+
+// Hands freshly computed TX hashes over to the sidecar, nothing to do when caching is off
+static void keepTXHashes(
+    const Block *block,
+    uint8_t     *hashes,
+    uint64_t    nbTX
+)
+{
+    if(0==getSourceCacheDir().size()) return;
+
+    TXHashPending entry;
+    entry.offset = block->data - mapVec[block->mapIndex].p;
+    entry.merkle = *(const uint64_t*)(4 + kSHA256ByteSize + block->data);
+    entry.nbTX = nbTX;
+    entry.hashes = hashes;
+    gTXHashFiles[block->mapIndex].pending.push_back(entry);
+}
+
+// Blocks follow the chain, not the files: a file is done with once its last block in the chain is
+static void doneTXHashes(
     const Block *block
 )
+{
+    TXHashFile &txHashFile = gTXHashFiles[block->mapIndex];
+    if(0==--txHashFile.nbLeft) saveTXHashFile(block->mapIndex);
+}
+
+static void scanUndoMap(
+    UndoMap &undoMap
+)
+{
+    const uint8_t *p = undoMap.p;
+    const uint8_t *e = undoMap.size + p;
+    while(1) {
+
+        if(unlikely(e<(8+p))) break;
+        LOAD(uint32_t, magic, p);
+        LOAD(uint32_t, size, p);
+        if(unlikely(kNetMagic!=magic)) break;
+        if(unlikely(e<(p+size+kSHA256ByteSize))) break;
+
+        UndoRecord record;
+        record.data = p;
+        record.size = size;
+        record.used = false;
+        undoMap.records.push_back(record);
+        p += size + kSHA256ByteSize;
+    }
+
+    undoMap.cursor = 0;
+    undoMap.scanned = true;
+}
+
+static const uint8_t *findUndo(
+    const Block *block,
+    uint64_t    nbTX
+)
+{
+    UndoMap &undoMap = gUndoMaps[block->mapIndex];
+    if(unlikely(0==undoMap.p)) errFatal("no undo file for %s", mapVec[block->mapIndex].name.c_str());
+    if(unlikely(!undoMap.scanned)) scanUndoMap(undoMap);
+
+    // Undo records carry no block hash: they're identified by their checksum,
+    // which is sha256Twice(prevBlockHash || record). Blocks get connected in
+    // chain order, so the search starts right after the last record used.
+    const uint8_t *prevHash = 4 + block->data;
+    size_t nbRecords = undoMap.records.size();
+    for(size_t k=0; k<nbRecords; ++k) {
+
+        size_t i = (undoMap.cursor + k) % nbRecords;
+        UndoRecord &record = undoMap.records[i];
+        if(record.used) continue;
+
+        const uint8_t *p = record.data;
+        LOAD_VARINT(nbTXUndo, p);
+        if(nbTX!=(1+nbTXUndo)) continue;
+
+        gUndoBuf.resize(kSHA256ByteSize + record.size);
+        memcpy(&gUndoBuf[0], prevHash, kSHA256ByteSize);
+        memcpy(&gUndoBuf[kSHA256ByteSize], record.data, record.size);
+
+        uint256_t checksum;
+        sha256Twice(checksum.v, &gUndoBuf[0], gUndoBuf.size());
+        if(0!=memcmp(checksum.v, record.data + record.size, kSHA256ByteSize)) continue;
+
+        record.used = true;
+        undoMap.cursor = 1 + i;
+        return p;
+    }
+
+    errFatal(
+        "no undo data for block at height %" PRIu64 " in %s",
+        (uint64_t)block->height,
+        undoMap.name.c_str()
+    );
+    return 0;
+}
+
+static void clearBatch(
+    const Block *block
+)
+{
+    gBatch.base = block->data;
+    gBatch.txInputs.clear();
+    gBatch.txOutputs.clear();
+    gBatch.outputValues.clear();
+    gBatch.outputScriptOffsets.clear();
+    gBatch.outputScriptSizes.clear();
+    gBatch.inputUpTXHashes.clear();
+    gBatch.inputUpIndices.clear();
+    gBatch.inputScriptOffsets.clear();
+    gBatch.inputScriptSizes.clear();
+    gBatch.inputValues.clear();
+    gBatch.inputUpScripts.clear();
+    gBatch.inputUpScriptSizes.clear();
+    gBatch.undoScripts.clear();
+}
+
+static void processBlock(
+    const Block   *block,
+    const uint8_t *txHashes
+)
+{
+    BlockBatch b;
+    b.block = block;
+    b.nbTX = gBatch.txInputs.size();
+    b.nbInputs = gBatch.inputUpTXHashes.size();
+    b.nbOutputs = gBatch.outputValues.size();
+    gBatch.txInputs.push_back(b.nbInputs);
+    gBatch.txOutputs.push_back(b.nbOutputs);
+
+    b.txHashes = txHashes;
+    b.txInputs = gBatch.txInputs.data();
+    b.txOutputs = gBatch.txOutputs.data();
+    b.outputValues = gBatch.outputValues.data();
+    b.outputScriptOffsets = gBatch.outputScriptOffsets.data();
+    b.outputScriptSizes = gBatch.outputScriptSizes.data();
+    b.inputUpTXHashes = gBatch.inputUpTXHashes.data();
+    b.inputUpIndices = gBatch.inputUpIndices.data();
+    b.inputScriptOffsets = gBatch.inputScriptOffsets.data();
+    b.inputScriptSizes = gBatch.inputScriptSizes.data();
+
+    bool resolved = (0!=(gNeeds & (kNeedEdges | kNeedBatchEdges)));
+    b.inputValues = resolved ? gBatch.inputValues.data() : 0;
+    b.inputUpScripts = resolved ? gBatch.inputUpScripts.data() : 0;
+    b.inputUpScriptSizes = resolved ? gBatch.inputUpScriptSizes.data() : 0;
+
+    gCallback->processBlock(b);
+}
+
+static void parseBlock(
+    const Block   *block,
+    const uint8_t *txHashes = 0,
+    bool          computed = false
+)
 {
     startBlock(block);
 
+        gCurMap = &mapVec[block->mapIndex];
         const uint8_t *p = block->data;
         const uint8_t *header = p;
         SKIP(uint32_t, version, p);
@@ -307,21 +1239,378 @@ static void parseBlock(
         SKIP(uint32_t, blkNonce, p);
 
         LOAD_VARINT(nbTX, p);
-        for(uint64_t txIndex=0; likely(txIndex<nbTX); ++txIndex)
-            parseTX<false>(p);
+        if(gNeedTXHash && 0==txHashes) {
+            txHashes = findTXHashes(block, nbTX);
+            if(0==txHashes) {
+                txHashes = hashTXs(p, nbTX);
+                computed = true;
+            }
+        }
+
+        // Blocks with a lone coinbase don't spend anything
+        if(gUseUndo) gUndo = (1<nbTX) ? findUndo(block, nbTX) : 0;
+
+        bool batch = (0!=(gNeeds & kNeedBatch));
+        if(batch) clearBatch(block);
+        gTXLoop(p, txHashes, nbTX);
+        if(batch) processBlock(block, txHashes);
+
+        if(computed) keepTXHashes(block, (uint8_t*)txHashes, nbTX);
+        if(gNeedTXHash) doneTXHashes(block);
 
     endBlock(block);
 }
 
+// Second pass pipeline: worker threads hash the TXs of upcoming blocks while
+// the main thread parses blocks and delivers callback events in chain order
+struct HashJob
+{
+    const uint8_t *hashes;
+    bool computed;
+    bool ready;
+};
+
+struct HashPipeline
+{
+    std::vector<const Block*> chain;
+    std::vector<HashJob> jobs;
+    std::atomic<size_t> next;
+    size_t consumed;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::thread> threads;
+};
+
+enum { kHashWindow = 256 };    // how far ahead of the main thread workers may run
+static HashPipeline *gHashPipeline;
+
+static void hashWorker(
+    HashPipeline *pipeline
+)
+{
+    size_t n = pipeline->chain.size();
+    while(1) {
+
+        size_t i = pipeline->next++;
+        if(n<=i) break;
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->cond.wait(lock, [&]() { return pipeline->stopping || i<(pipeline->consumed + kHashWindow); });
+            if(pipeline->stopping) break;
+        }
+
+        const Block *block = pipeline->chain[i];
+        const uint8_t *p = 80 + block->data;
+        LOAD_VARINT(nbTX, p);
+
+        HashJob &job = pipeline->jobs[i];
+        job.computed = false;
+        job.hashes = findTXHashes(block, nbTX);
+        if(0==job.hashes) {
+            job.hashes = hashTXs(p, nbTX);
+            job.computed = true;
+        } else {
+            // Cached hashes: still fault the block in, so the main thread doesn't wait on I/O
+            const uint8_t *e = block->data + ((const uint32_t*)block->data)[-1];
+            volatile uint8_t sum = 0;
+            while(p<e) { sum += *p; p += 4096; }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            job.ready = true;
+        }
+        pipeline->cond.notify_all();
+    }
+}
+
+// Runs at exit (e.g. a callback bailing out early), before the TX hash sidecars are saved
+static void stopHashPipeline()
+{
+    HashPipeline *pipeline = gHashPipeline;
+    if(0==pipeline) return;
+
+    {
+        std::unique_lock<std::mutex> lock(pipeline->mutex);
+        pipeline->stopping = true;
+    }
+    pipeline->cond.notify_all();
+
+    for(auto &t : pipeline->threads) t.join();
+    pipeline->threads.clear();
+}
+
+// Second pass readahead: a thread walks the chain a few blocks ahead of the
+// parser and pulls their byte ranges into the page cache, because blocks sit
+// in blk files in download order rather than in chain order
+enum { kReadaheadDepth = 64 };    // default number of blocks fetched ahead of the parser
+
+struct Readahead
+{
+    const Block *first;
+    size_t depth;
+    size_t nbFetched;
+    size_t nbParsed;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+static Readahead *gReadahead;
+
+// How often the parser had to wait on the disk
+static uint64_t gNbBlocksParsed;
+static uint64_t gNbStalledBlocks;
+static uint64_t gNbMajorFaults;
+static uint64_t gNbBehind;
+
+static size_t getReadaheadDepth()
+{
+    const char *s = getenv("READAHEAD");
+    if(0==s) return kReadaheadDepth;
+    return (size_t)atol(s);
+}
+
+static void fetchBlock(
+    const Block *block
+)
+{
+    const Map &map = mapVec[block->mapIndex];
+    const uint8_t *p = block->data - 8;
+    uint64_t size = 8 + ((const uint32_t*)block->data)[-1];
+    if(0==readahead(map.fd, p - map.p, size)) return;
+
+    // readahead(2) is Linux only, and refused by some file systems
+    uintptr_t page = ~(uintptr_t)4095;
+    uintptr_t from = page & (uintptr_t)p;
+    uintptr_t to = page & (uintptr_t)(p + size + 4095);
+    madvise((void*)from, to - from, MADV_WILLNEED);
+}
+
+static void readaheadWorker(
+    Readahead *ra
+)
+{
+    const Block *block = ra->first;
+    for(size_t i=0; 0!=block; ++i) {
+
+        {
+            std::unique_lock<std::mutex> lock(ra->mutex);
+            ra->cond.wait(lock, [&]() { return ra->stopping || i<(ra->nbParsed + ra->depth); });
+            if(ra->stopping) break;
+        }
+
+        fetchBlock(block);
+        block = block->next;
+
+        std::unique_lock<std::mutex> lock(ra->mutex);
+        ra->nbFetched = 1 + i;
+    }
+}
+
+static void stopReadahead()
+{
+    Readahead *ra = gReadahead;
+    if(0==ra) return;
+
+    {
+        std::unique_lock<std::mutex> lock(ra->mutex);
+        ra->stopping = true;
+    }
+    ra->cond.notify_all();
+
+    if(ra->thread.joinable()) ra->thread.join();
+}
+
+static void startReadahead(
+    const Block *first
+)
+{
+    size_t depth = getReadaheadDepth();
+    if(0==depth) return;
+
+    // Never freed: the thread may still be around if a callback calls exit()
+    Readahead *ra = gReadahead = new Readahead;
+    ra->first = first;
+    ra->depth = depth;
+    ra->nbFetched = 0;
+    ra->nbParsed = 0;
+    ra->stopping = false;
+
+    atexit(stopReadahead);
+    ra->thread = std::thread(readaheadWorker, ra);
+    info("reading %d blocks ahead of the parser", (int)depth);
+}
+
+static uint64_t majorFaults()
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_THREAD, &usage)<0) return 0;
+    return usage.ru_majflt;
+}
+
+// Parse the next block of the chain on the main thread, keeping track of page faults that
+// had to go to the disk, and letting the readahead thread move one block further
+static void parseChainBlock(
+    const Block   *block,
+    const uint8_t *txHashes = 0,
+    bool          computed = false
+)
+{
+    Readahead *ra = gReadahead;
+    if(ra) {
+        std::unique_lock<std::mutex> lock(ra->mutex);
+        gNbBehind += (ra->nbFetched<=ra->nbParsed);
+    }
+
+    uint64_t faults = majorFaults();
+    parseBlock(block, txHashes, computed);
+    faults = majorFaults() - faults;
+
+    ++gNbBlocksParsed;
+    gNbMajorFaults += faults;
+    gNbStalledBlocks += (0<faults);
+
+    if(ra) {
+        {
+            std::unique_lock<std::mutex> lock(ra->mutex);
+            ra->nbParsed = gNbBlocksParsed;
+        }
+        ra->cond.notify_all();
+    }
+}
+
+static void reportStalls()
+{
+    if(0==gNbBlocksParsed) return;
+    info(
+        "parser stalled on the disk in %" PRIu64 " of %" PRIu64 " blocks (%.2f%%), %" PRIu64 " major page faults",
+        gNbStalledBlocks,
+        gNbBlocksParsed,
+        (100.0*gNbStalledBlocks)/gNbBlocksParsed,
+        gNbMajorFaults
+    );
+    if(gReadahead) {
+        info(
+            "readahead was behind the parser on %" PRIu64 " blocks",
+            gNbBehind
+        );
+    }
+}
+
+// Shardable callbacks: each thread parses a contiguous range of the chain
+// with its own clone of the callback, results get merged in chain order
+static bool parseShards(
+    Block *blk
+)
+{
+    // Address ids are handed out in chain order, by a single thread
+    size_t nbThreads = getNbThreads();
+    if(gNeedTXHash || 0!=gAddrDict || nbThreads<2) return false;
+
+    std::vector<Callback*> shards;
+    for(size_t i=1; i<nbThreads; ++i) {
+        Callback *shard = gCallback->clone();
+        if(0==shard) return false;
+        shards.push_back(shard);
+    }
+    shards.insert(shards.begin(), gCallback);
+
+    // Split the chain in ranges of roughly equal byte size
+    std::vector<Block*> chain;
+    while(likely(0!=blk)) {
+        chain.push_back(blk);
+        blk = blk->next;
+    }
+
+    std::vector<size_t> cuts(1, 0);
+    uint64_t total = 0;
+    for(size_t i=0; i<chain.size(); ++i) {
+        total += ((const uint32_t*)chain[i]->data)[-1];
+        if(cuts.size()<nbThreads && (gChainSize*cuts.size())<=(total*nbThreads)) cuts.push_back(1+i);
+    }
+    while(cuts.size()<=nbThreads) cuts.push_back(chain.size());
+
+    auto worker = [&](size_t k) {
+        gCallback = shards[k];
+        for(size_t i=cuts[k]; i<cuts[1+k]; ++i) parseBlock(chain[i]);
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t k=1; k<nbThreads; ++k)
+        threads.push_back(std::thread(worker, k));
+
+    worker(0);
+    for(auto &t : threads) t.join();
+
+    for(size_t k=1; k<nbThreads; ++k) {
+        gCallback->merge(shards[k]);
+        delete shards[k];
+    }
+
+    info("parsed the chain in %d shards", (int)nbThreads);
+    return true;
+}
+
 static void parseLongestChain()
 {
     Block *blk = gNullBlock->next;
-
     start(blk, gMaxBlock);
+
+    if(parseShards(blk)) return;
+
+    startReadahead(blk);
+
+    size_t nbThreads = getNbThreads();
+    if(!gNeedTXHash || nbThreads<2) {
+        while(likely(0!=blk)) {
+            parseChainBlock(blk);
+            blk = blk->next;
+        }
+        stopReadahead();
+        return;
+    }
+
+    // Never freed: workers may still be around if a callback calls exit()
+    HashPipeline *pipeline = gHashPipeline = new HashPipeline;
     while(likely(0!=blk)) {
-        parseBlock(blk);
+        pipeline->chain.push_back(blk);
         blk = blk->next;
     }
+
+    size_t n = pipeline->chain.size();
+    pipeline->jobs.resize(n);
+    pipeline->next = 0;
+    pipeline->consumed = 0;
+    pipeline->stopping = false;
+    for(size_t i=0; i<n; ++i) pipeline->jobs[i].ready = false;
+
+    atexit(stopHashPipeline);
+    for(size_t i=1; i<nbThreads; ++i)
+        pipeline->threads.push_back(std::thread(hashWorker, pipeline));
+
+    for(size_t i=0; i<n; ++i) {
+
+        HashJob &job = pipeline->jobs[i];
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->cond.wait(lock, [&]() { return job.ready; });
+        }
+
+        parseChainBlock(pipeline->chain[i], job.hashes, job.computed);
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->consumed = 1 + i;
+        }
+        pipeline->cond.notify_all();
+    }
+
+    stopHashPipeline();
+    stopReadahead();
 }
 
 static void findLongestChain()
@@ -333,6 +1622,10 @@ static void findLongestChain()
             const uint8_t *p = -4 + (block->data);
             LOAD(uint32_t, size, p);
             gChainSize += size;
+
+            p = 80 + (block->data);
+            LOAD_VARINT(nbTX, p);
+            gChainTXCount += nbTX;
         }
 
         Block *prev = block->prev;
@@ -342,7 +1635,14 @@ static void findLongestChain()
     }
 }
 
-static void initCallback(
+#if defined(DEVIRT)
+    // Devirtualised build (see Makefile): the command is compiled in, so that the
+    // parse loop can be instantiated over its concrete type and its handlers inlined
+    #include DEVIRT_SRC
+    typedef decltype(DEVIRT) DevirtCallback;
+#endif
+
+static Callback *initOneCallback(
     int  argc,
     char *argv[]
 )
@@ -351,23 +1651,170 @@ static void initCallback(
     if(0<argc) methodName = argv[1];
     if(0==methodName) methodName = "";
     if(0==methodName[0]) methodName = "help";
-    gCallback = Callback::find(methodName);
+    Callback *callback = Callback::find(methodName);
     fprintf(stderr, "\n");
 
-    info("starting command \"%s\"", gCallback->name());
+    info("starting command \"%s\"", callback->name());
 
     if(argv[1]) {
         int i = 0;
         while('-'==argv[1][i]) argv[1][i++] = 'x';
     }
 
-    int ir = gCallback->init(argc, (const char **)argv);
+    int ir = callback->init(argc, (const char **)argv);
     if(ir<0) errFatal("callback init failed");
-    gNeedTXHash = gCallback->needTXHash();
+    return callback;
+}
+
+static void initCallback(
+    int  argc,
+    char *argv[]
+)
+{
+    // Several commands can run in the same pass: parser cmd1 <options> + cmd2 <options> + ...
+    std::vector<Callback*> callbacks;
+    int first = 1;
+    while(1) {
+
+        int last = first;
+        while(last<argc && 0!=strcmp("+", argv[last])) ++last;
+
+        // Each command gets its own argv, laid out as if it were the only one
+        char **subArgv = (char**)malloc((2 + last - first)*sizeof(char*));
+        subArgv[0] = argv[0];
+        for(int i=first; i<last; ++i) subArgv[1 + i - first] = argv[i];
+        subArgv[1 + last - first] = 0;
+
+        Callback *callback = initOneCallback(1 + last - first, subArgv);
+        if(callbacks.end()!=std::find(callbacks.begin(), callbacks.end(), callback))
+            errFatal("command \"%s\" given more than once", callback->name());
+        callbacks.push_back(callback);
+
+        if(argc<=last) break;
+        first = 1 + last;
+    }
+
+    gCallback = Callback::combine(callbacks);
+
+    gNeeds = gCallback->needs();
+    if(0==(gNeeds & kNeedBatch)) gNeeds &= ~kNeedBatchEdges;
+
+    // Coinbases never spend anything
+    if(gNeeds & kNeedCoinbaseOnly) gNeeds &= ~(kNeedEdges | kNeedBatchEdges);
+    gNeedTXHash = (0!=(gNeeds & (kNeedTXHash | kNeedEdges | kNeedBatchEdges)));
+    if(gNeeds & kNeedAddrId) gNeeds |= kNeedScriptInfo;
+    gNeedScriptInfo = (0!=(gNeeds & kNeedScriptInfo));
+    gTXLoop = TXLoops<Callback>::loops[gNeeds & (kNeedTXHash - 1)];
+
+    #if defined(DEVIRT)
+        if(typeid(*gCallback)==typeid(DevirtCallback)) {
+            gTXLoop = TXLoops<DevirtCallback>::loops[gNeeds & (kNeedTXHash - 1)];
+            info("using devirtualised parse loop");
+        }
+    #endif
+
+    const char *useUndo = getenv("USEUNDO");
+    bool needEdges = (0!=(gNeeds & (kNeedEdges | kNeedBatchEdges)));
+    gUseUndo = needEdges && useUndo && 0!=atoi(useUndo);
+    gNeedTXMap = needEdges && !gUseUndo;
+    if(gUseUndo) info("resolving edges from undo files");
+}
+
+static void mapUndoFile(
+    const std::string &dataDir,
+    int               id
+)
+{
+    char buf[64];
+    sprintf(buf, "blocks/rev%05d.dat", id);
+
+    UndoMap undoMap;
+    undoMap.fd = -1;
+    undoMap.size = 0;
+    undoMap.p = 0;
+    undoMap.name = dataDir + std::string(buf);
+    undoMap.scanned = false;
+    undoMap.cursor = 0;
+
+    int fd = open(undoMap.name.c_str(), O_RDONLY);
+    if(0<=fd) {
+
+        struct stat statBuf;
+        int r = fstat(fd, &statBuf);
+        if(r<0) sysErrFatal("failed to fstat undo file %s", undoMap.name.c_str());
+
+        void *pMap = mmap(0, statBuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(((void*)-1)==pMap) sysErrFatal("failed to mmap undo file %s", undoMap.name.c_str());
+
+        undoMap.fd = fd;
+        undoMap.size = statBuf.st_size;
+        undoMap.p = (const uint8_t*)pMap;
+    }
+
+    gUndoMaps.push_back(undoMap);
+}
+
+// Mapped for the random accesses of the second pass, the first pass reads through FileStream
+static bool mapBlockChainFile(
+    const std::string &blockMapFileName
+)
+{
+    int blockMapFD = open(blockMapFileName.c_str(), O_RDONLY);
+    if(blockMapFD<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(blockMapFD, &statBuf);
+    if(r<0) sysErrFatal( "failed to fstat block chain file %s", blockMapFileName.c_str());
+
+    size_t mapSize = statBuf.st_size;
+    void *pMap = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, blockMapFD, 0);
+    if(((void*)-1)==pMap) {
+        sysErrFatal(
+            "failed to mmap block chain file %s",
+            blockMapFileName.c_str()
+        );
+    }
+
+    Map map;
+    map.scanEnd = 0;
+    map.size = mapSize;
+    map.mtime = statBuf.st_mtim.tv_sec*1000000000LL + statBuf.st_mtim.tv_nsec;
+    map.fd = blockMapFD;
+    map.name = blockMapFileName;
+    map.p = (const uint8_t*)pMap;
+    mapVec.push_back(map);
+    return true;
+}
+
+// Chain store written by the compact command: its index says which files make it up
+static void mapChainStore(
+    const std::string &storeDir
+)
+{
+    if(gUseUndo) errFatal("USEUNDO can't be used with a chain store");
+    if(!gStoreIndex.load(storeDir)) errFatal("no valid chain store in %s, run \"parser compact\" first", storeDir.c_str());
+
+    for(size_t i=0; i<gStoreIndex.nbFiles(); ++i) {
+        std::string name = storeFileName(storeDir, i);
+        if(!mapBlockChainFile(name)) sysErrFatal("failed to open chain store file %s", name.c_str());
+        if(gStoreIndex.fileSizes[i]!=mapVec.back().size) errFatal("chain store file %s was modified", name.c_str());
+    }
+
+    info(
+        "reading %" PRIu64 " blocks from chain store %s",
+        gStoreIndex.nbBlocks(),
+        storeDir.c_str()
+    );
 }
 
 static void mapBlockChainFiles()
 {
+    const std::string &storeDir = getStoreDir();
+    if(0!=storeDir.size()) {
+        mapChainStore(storeDir);
+        return;
+    }
+
     std::string coinName(
         #if defined LITECOIN
             "/.litecoin/"
@@ -397,6 +1844,8 @@ static void mapBlockChainFiles()
     int r = stat(blockDir.c_str(), &statBuf);
     bool oldStyle = (r<0 || !S_ISDIR(statBuf.st_mode));
 
+    if(gUseUndo && oldStyle) errFatal("USEUNDO needs a datadir with a blocks/ directory");
+
     int blkDatId = oldStyle ? 1 : 0;
     const char *fmt = oldStyle ? "blk%04d.dat" : "blocks/blk%05d.dat";
     while(1) {
@@ -407,8 +1856,7 @@ static void mapBlockChainFiles()
         std::string blockMapFileName = dataDir + std::string(buf)
         ;
 
-        int blockMapFD = open(blockMapFileName.c_str(), O_DIRECT | O_RDONLY);
-        if(blockMapFD<0) {
+        if(!mapBlockChainFile(blockMapFileName)) {
             if(1<blkDatId) break;
             sysErrFatal(
                 "failed to open block chain file %s",
@@ -416,42 +1864,56 @@ static void mapBlockChainFiles()
             );
         }
 
-        struct stat statBuf;
-        int r = fstat(blockMapFD, &statBuf);
-        if(r<0) sysErrFatal( "failed to fstat block chain file %s", blockMapFileName.c_str());
+        if(gUseUndo) mapUndoFile(dataDir, blkDatId - 1);
+    }
+}
 
-        size_t mapSize = statBuf.st_size;
-        void *pMap = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, blockMapFD, 0);
-        if(((void*)-1)==pMap) {
-            sysErrFatal(
-                "failed to mmap block chain file %s",
-                blockMapFileName.c_str()
-            );
-        }
+// Cached files are kept apart per source of blocks (a datadir or a chain store) and network
+static void initCaches()
+{
+    std::string name = mapVec.size() ? mapVec[0].name : std::string();
+    size_t slash = name.rfind('/');
+    std::string source = (std::string::npos==slash) ? std::string(".") : name.substr(0, slash);
+
+    char buf[32];
+    sprintf(buf, ":%08x", (uint32_t)kNetMagic);
+    setCacheSource(source + buf);
+
+    if(gNeeds & kNeedAddrId) gAddrDict = &getAddrDict();
+}
 
-        Map map;
-        map.size = mapSize;
-        map.fd = blockMapFD;
-        map.name = blockMapFileName;
-        map.p = (const uint8_t*)pMap;
-        mapVec.push_back(map);
+static void initTXMap()
+{
+    if(TXMap::kMapMask<mapVec.size())
+        errFatal("too many block chain files (%d)", (int)mapVec.size());
+
+    auto e = mapVec.end();
+    auto i = mapVec.begin();
+    while(i!=e) {
+        const Map &map = *(i++);
+        if(TXMap::kOffsetMask<map.size)
+            errFatal("block chain file %s is too large", map.name.c_str());
     }
+
+    // Fully spent TXs get evicted, so the map only ever holds a fraction of
+    // the chain's TXs: start small and let it grow if that guess is wrong
+    gTXMap.init(gChainTXCount/4, verifyTX, gNeedScriptInfo, gAddrDict);
+    info(
+        "TX map sized for %" PRIu64 " live transactions (%.2f MB)",
+        gChainTXCount/4,
+        gTXMap.memSize()*1e-6
+    );
 }
 
 static void initHashtables()
 {
-    gTXMap.setEmptyKey(empty);
-    gBlockMap.setEmptyKey(empty);
+    gBlockMap.setEmptyKey(gEmptyKey);
 
     auto e = mapVec.end();
     uint64_t totalSize = 0;
     auto i = mapVec.begin();
     while(i!=e) totalSize += (i++)->size;
 
-    double txPerBytes = (3976774.0 / 1713189944.0);
-    size_t nbTxEstimate = (1.5 * txPerBytes * totalSize);
-    gTXMap.resize(nbTxEstimate);
-
     double blocksPerBytes = (184284.0 / 1713189944.0);
     size_t nbBlockEstimate = (1.5 * blocksPerBytes * totalSize);
     gBlockMap.resize(nbBlockEstimate);
@@ -515,76 +1977,303 @@ static void linkAllBlocks()
     }
 }
 
-static bool buildBlock(
-    const uint8_t *&p,
-    const uint8_t *e
+// Past a bad frame, look for the next one at memory bandwidth: Bitcoin Core preallocates blk files
+// with zeros, and a torn write leaves junk behind, neither of which should cost the rest of the file
+enum
+{
+    kMaxBlockSize = 32*1024*1024,       // largest message the network carries
+    kResyncStep = 64*1024,
+};
+
+static inline bool isFrame(
+    const uint8_t *p,
+    uint64_t      room                  // bytes left in the file from p
 )
 {
-    static const uint32_t expected =
-#if defined(LITECOIN)
-        0xdbb6c0fb
-#else
-#if defined(TESTNET)
-        0x0709110b
-#else
-        0xd9b4bef9
-#endif
-#endif
-    ;
+    LOAD(uint32_t, magic, p);
+    LOAD(uint32_t, size, p);
+    return kNetMagic==magic && 80<=size && size<=kMaxBlockSize && (8 + (uint64_t)size)<=room;
+}
 
-    if(unlikely(e<=(8+p))) {
+// First frame that starts in [p, e - 8], or else the first position in there that wasn't looked at.
+// All bytes skipped on the way get ored into seen, so callers can tell zero padding from damage.
+static const uint8_t *findFrame(
+    const uint8_t *p,
+    const uint8_t *e,
+    uint64_t      room,
+    uint8_t       &seen,
+    bool          &found
+)
+{
+    const __m128i first = _mm_set1_epi8((char)(kNetMagic & 0xFF));
+    __m128i acc = _mm_setzero_si128();
+    const uint8_t *q = p;
+    found = false;
+
+    while(likely(q + 16 + 7<=e)) {
+        __m128i v = _mm_loadu_si128((const __m128i*)q);
+        uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, first));
+        while(unlikely(0!=m)) {
+            const uint8_t *c = q + __builtin_ctz(m);
+            if(isFrame(c, room - (c - p))) {
+                while(q<c) seen |= *(q++);
+                found = true;
+                break;
+            }
+            m &= m - 1;
+        }
+        if(found) break;
+
+        acc = _mm_or_si128(acc, v);
+        q += 16;
+    }
+
+    while(!found && q + 8<=e) {
+        if(isFrame(q, room - (q - p))) found = true;
+        else seen |= *(q++);
+    }
+
+    // Any non zero byte went through acc: a lone non zero lane is all it takes
+    seen |= (0xFFFF!=_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())));
+    return q;
+}
+
+// Moves offset to the next frame past it, false if there's none till the end of the map
+static bool resync(
+    FileStream &stream,
+    const Map  &map,
+    uint64_t   &offset,
+    bool       &zeros
+)
+{
+    uint8_t seen = 0;
+    uint64_t pos = 1 + offset;
+    while(pos + 8<=map.size) {
+
+        uint64_t n = std::min((uint64_t)kResyncStep, map.size - pos);
+        const uint8_t *p = stream.at(pos, n);
+        if(unlikely(0==p)) break;
+
+        bool found;
+        const uint8_t *q = findFrame(p, p + n, map.size - pos, seen, found);
+        pos += q - p;
+        if(found) {
+            offset = pos;
+            zeros = (0==seen);
+            return true;
+        }
+    }
+
+    zeros = (0==seen);
+    return false;
+}
+
+// Reads the next block's framing and header off the stream, false at the end of the map
+static bool scanBlock(
+    FileStream &stream,
+    const Map  &map,
+    uint64_t   &offset,
+    BlockRef   &ref
+)
+{
+    const uint8_t *p = stream.at(offset, 8 + sizeof(ref.header));
+    if(unlikely(0==p)) {
         //printf("end of map, reason : pointer past EOF\n");
-        return true;
+        return false;
     }
 
     LOAD(uint32_t, magic, p);
-    if(unlikely(expected!=magic)) {
-        //printf("end of map, reason : magic is fucked %d away from EOF\n", (int)(e-p));
-        return true;
+    if(unlikely(kNetMagic!=magic)) {
+        //printf("end of map, reason : magic is fucked %d away from EOF\n", (int)(map.size-offset));
+        return false;
     }
 
     LOAD(uint32_t, size, p);
-    if(unlikely(e<(p+size))) {
-        //printf("end of map, reason : end of block past EOF, %d past EOF\n", (int)((p+size)-e));
-        return true;
+    if(unlikely(map.size<(offset + 8 + size) || size<sizeof(ref.header) || kMaxBlockSize<size)) {
+        //printf("end of map, reason : end of block past EOF\n");
+        return false;
+    }
+
+    memcpy(ref.header, p, sizeof(ref.header));
+    ref.data = map.p + offset + 8;
+    offset += 8 + size;
+    return true;
+}
+
+static void scanMap(
+    MapScan &scan
+)
+{
+    // Goes through the I/O backend: only the mmap one faults the file in
+    const Map *map = scan.map;
+    uint64_t offset = map->scanEnd;
+    FileStream stream(map->name, map->p, offset, map->size);
+
+    while(1) {
+
+        BlockRef ref;
+        if(likely(scanBlock(stream, *map, offset, ref))) {
+            scan.blocks.push_back(ref);
+            continue;
+        }
+
+        // Nothing but zeros till the end is the usual preallocated tail, and where appended blocks will go
+        uint64_t from = offset;
+        bool zeros = true;
+        if(!resync(stream, *map, offset, zeros)) {
+            if(!zeros) {
+                warning(
+                    "%s: no block in the last %" PRIu64 " bytes, past offset %" PRIu64,
+                    map->name.c_str(),
+                    map->size - from,
+                    from
+                );
+            }
+            offset = from;
+            break;
+        }
+
+        warning(
+            "%s: skipped %" PRIu64 " %s bytes at offset %" PRIu64,
+            map->name.c_str(),
+            offset - from,
+            zeros ? "zero" : "unparseable",
+            from
+        );
+    }
+    scan.end = map->p + offset;
+
+    // Block hashes: all the headers of the map in one go
+    size_t nbBlocks = scan.blocks.size();
+    std::vector<uint8_t*> results(nbBlocks);
+    std::vector<const uint8_t*> headers(nbBlocks);
+    for(size_t i=0; i<nbBlocks; ++i) {
+        results[i] = scan.blocks[i].hash.v;
+        headers[i] = scan.blocks[i].header;
     }
+    hashHeaders(results.data(), headers.data(), nbBlocks);
+}
 
+static void buildBlock(
+    const BlockRef &ref,
+    uint32_t       mapIndex
+)
+{
     Block *block = allocBlock();
     block->height = -1;
-    block->data = p;
+    block->data = ref.data;
     block->prev = 0;
     block->next = 0;
+    block->mapIndex = mapIndex;
 
     uint8_t *hash = allocHash256();
-    sha256Twice(hash, p, 80);
+    memcpy(hash, ref.hash.v, kSHA256ByteSize);
     gBlockMap[hash] = block;
-    p += size;
-    return false;
+}
+
+enum { kProbeThreadsPerCore = 4 };
+
+static void scanAllMaps(
+    std::vector<MapScan> &scans
+)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        while(1) {
+            size_t i = next++;
+            if(scans.size()<=i) break;
+            if(!scans[i].indexed) scanMap(scans[i]);
+        }
+    };
+
+    // Header probes are small reads that each depend on the last one: within a file, nothing can
+    // be batched, so keep more files going than there are cores to give the disk a deep enough queue
+    size_t nbThreads = getNbThreads();
+    if(kIOHeaders==getIOBackend()) nbThreads *= kProbeThreadsPerCore;
+    nbThreads = std::min(nbThreads, scans.size());
+
+    std::vector<std::thread> threads;
+    for(size_t i=1; i<nbThreads; ++i)
+        threads.push_back(std::thread(worker));
+
+    worker();
+    for(auto &t : threads) t.join();
+}
+
+// Blocks of a chain store come with their hashes: files that weren't seen before need no scan at all
+static void indexStoreBlocks(
+    std::vector<MapScan> &scans
+)
+{
+    if(0==gStoreIndex.nbBlocks()) return;
+
+    for(size_t i=0; i<scans.size(); ++i) {
+        MapScan &scan = scans[i];
+        scan.indexed = (0==scan.map->scanEnd);
+        scan.end = scan.map->p + scan.map->size;
+    }
+
+    for(size_t i=0; i<gStoreIndex.nbBlocks(); ++i) {
+
+        const StoreIndexEntry &entry = gStoreIndex.entries[i];
+        if(unlikely(scans.size()<=entry.fileIndex)) errFatal("chain store index is corrupt");
+
+        MapScan &scan = scans[entry.fileIndex];
+        if(!scan.indexed) continue;
+
+        const Map *map = scan.map;
+        if(unlikely(entry.offset<8 || map->size<entry.offset + 80)) errFatal("chain store index is corrupt");
+
+        BlockRef ref;
+        ref.hash = entry.hash;
+        ref.data = map->p + entry.offset;
+        scan.blocks.push_back(ref);
+    }
 }
 
 static void buildAllBlocks()
 {
-    auto e = mapVec.end();
-    auto i = mapVec.begin();
-    while(i!=e) {
+    std::vector<MapScan> scans(mapVec.size());
+    for(size_t i=0; i<mapVec.size(); ++i) {
+        scans[i].mapIndex = i;
+        scans[i].indexed = false;
+        scans[i].map = &mapVec[i];
+    }
+    indexStoreBlocks(scans);
+
+    info("scanning block chain files through %s", ioBackendName(getIOBackend()));
+    scanAllMaps(scans);
 
+    if(kIOMmap!=getIOBackend()) {
+        uint64_t total = 0;
+        for(size_t i=0; i<scans.size(); ++i) {
+            if(!scans[i].indexed) total += mapVec[i].size - mapVec[i].scanEnd;
+        }
+        info("read %.2f MB off %.2f MB of block chain files", getIOBytesRead()*1e-6, total*1e-6);
+    }
+
+    auto e = scans.end();
+    auto i = scans.begin();
+    while(i!=e) {
 
-        const Map *map = gCurMap = &(*(i++));
-        const uint8_t *end = map->size + map->p;
-        const uint8_t *p = map->p;
+        const MapScan &scan = *(i++);
+        Map *map = &mapVec[scan.mapIndex];
+        gCurMap = map;
 
         std::cout << "Processing " << map->name << std::endl;
-        std::cout << int64_t(p) << " " << int64_t(end) << std::endl;
+        std::cout << int64_t(map->p) << " " << int64_t(map->size + map->p) << std::endl;
 
-        startMap(p);
+        startMap(map->p);
 
-            while(1) {
-                if(unlikely(end<=p)) break;
-                bool done = buildBlock(p, end);
-                if(done) break;
-            }
+            auto be = scan.blocks.end();
+            auto bi = scan.blocks.begin();
+            while(bi!=be) buildBlock(*(bi++), scan.mapIndex);
+
+        endMap(scan.end);
 
-        endMap(p);
+        uint64_t scanEnd = scan.end - map->p;
+        if(scanEnd!=map->scanEnd) gBlockIndexStale = true;
+        map->scanEnd = scanEnd;
     }
 }
 
@@ -592,19 +2281,308 @@ static void buildNullBlock()
 {
     gBlockMap[gNullHash.v] = gNullBlock = allocBlock();
     gNullBlock->data = 0;
+    gNullBlock->mapIndex = -1;
+}
+
+// One cache per source of blocks (a datadir or a chain store), so that switching between them doesn't thrash it
+static std::string blockIndexFileName()
+{
+    const std::string &cacheDir = getSourceCacheDir();
+    if(0==cacheDir.size()) return cacheDir;
+    return cacheDir + "blockIndex";
+}
+
+static uint64_t blockIndexChecksum(
+    const BlockIndexMap   *maps,
+    uint64_t              nbMaps,
+    const BlockIndexEntry *entries,
+    uint64_t              nbBlocks
+)
+{
+    return
+        checksum64(maps, nbMaps*sizeof(BlockIndexMap))              ^
+        checksum64(entries, nbBlocks*sizeof(BlockIndexEntry))
+    ;
+}
+
+static bool loadBlockIndex()
+{
+    std::string fileName = blockIndexFileName();
+    if(0==fileName.size()) return false;
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(fd, &statBuf);
+    if(r<0 || statBuf.st_size<(off_t)sizeof(BlockIndexHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = statBuf.st_size;
+    void *pMap = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(((void*)-1)==pMap) {
+        sysErr("failed to mmap block index cache %s", fileName.c_str());
+        return false;
+    }
+
+    const uint8_t *p = (const uint8_t*)pMap;
+    const BlockIndexHeader *header = (const BlockIndexHeader*)p;
+    const BlockIndexMap *maps = (const BlockIndexMap*)(header + 1);
+    const BlockIndexEntry *entries = (const BlockIndexEntry*)(maps + header->nbMaps);
+
+    bool ok = (
+        kBlockIndexMagic==header->magic             &&
+        header->nbMaps<=mapVec.size()               &&
+        header->nbBlocks<=size                      &&
+        size==(
+            sizeof(BlockIndexHeader)                    +
+            header->nbMaps*sizeof(BlockIndexMap)        +
+            header->nbBlocks*sizeof(BlockIndexEntry)
+        )                                           &&
+        header->checksum==blockIndexChecksum(maps, header->nbMaps, entries, header->nbBlocks)
+    );
+
+    gBlockIndexStale = (header->nbMaps!=mapVec.size());
+    std::vector<bool> changed(ok ? header->nbMaps : 0);
+    for(uint64_t i=0; ok && i<header->nbMaps; ++i) {
+
+        const Map &map = mapVec[i];
+        const BlockIndexMap &cached = maps[i];
+
+        // blk files only ever grow: anything else means the cache is useless
+        ok = (
+            0==strncmp(cached.name, map.name.c_str(), sizeof(cached.name))  &&
+            cached.size<=map.size                                           &&
+            cached.scanEnd<=map.size
+        );
+
+        bool unchanged = (cached.size==map.size && cached.mtime==map.mtime);
+        if(!unchanged) gBlockIndexStale = true;
+        changed[i] = !unchanged;
+    }
+
+    // Every index in there must point inside the cache, and every block inside what was scanned of its file
+    int64_t nbBlocks = header->nbBlocks;
+    uint64_t nbNull = 0;
+    ok = ok && (-1<=header->maxBlock && header->maxBlock<nbBlocks);
+    for(int64_t i=0; ok && i<nbBlocks; ++i) {
+        const BlockIndexEntry &entry = entries[i];
+        if((uint64_t)(uint32_t)-1==entry.mapIndex) {
+            ++nbNull;
+        } else {
+            ok = (
+                entry.mapIndex<header->nbMaps                       &&
+                8<=entry.offset                                     &&
+                (entry.offset + 80)<=maps[entry.mapIndex].scanEnd
+            );
+        }
+        ok = ok && (-1<=entry.prev && entry.prev<nbBlocks);
+    }
+    ok = ok && (1==nbNull);
+
+    if(!ok) {
+        info("block index cache %s is stale or damaged, rebuilding it", fileName.c_str());
+        munmap(pMap, size);
+        return false;
+    }
+
+    // bitcoind preallocates blk files, so one rewritten by a reindex usually keeps its size: the blocks
+    // cached for a file that changed must still hash right, else that whole file gets scanned again
+    std::vector<bool> dropped(header->nbMaps);
+    bool relink = false;
+    for(int64_t i=0; i<nbBlocks; ++i) {
+
+        const BlockIndexEntry &entry = entries[i];
+        if((uint64_t)(uint32_t)-1==entry.mapIndex) continue;
+        if(!changed[entry.mapIndex] || dropped[entry.mapIndex]) continue;
+
+        uint256_t hash;
+        hashHeader(hash.v, entry.offset + mapVec[entry.mapIndex].p);
+        if(likely(0==memcmp(hash.v, entry.hash.v, kSHA256ByteSize))) continue;
+
+        warning("block chain file %s was rewritten, scanning it again", mapVec[entry.mapIndex].name.c_str());
+        dropped[entry.mapIndex] = true;
+        relink = true;
+    }
+
+    std::vector<Block*> blocks(header->nbBlocks);
+    for(uint64_t i=0; i<header->nbBlocks; ++i) {
+
+        const BlockIndexEntry &entry = entries[i];
+        bool isNull = ((uint64_t)(uint32_t)-1==entry.mapIndex);
+        if(unlikely(!isNull && dropped[entry.mapIndex])) {
+            blocks[i] = 0;
+            continue;
+        }
+
+        Block *block = blocks[i] = allocBlock();
+        block->mapIndex = entry.mapIndex;
+        block->height = entry.height;
+        block->next = 0;
+
+        if(unlikely((uint32_t)-1==block->mapIndex)) {
+            block->data = 0;
+            gNullBlock = block;
+        } else {
+            block->data = entry.offset + mapVec[entry.mapIndex].p;
+        }
+    }
+
+    for(uint64_t i=0; i<header->nbBlocks; ++i) {
+        const BlockIndexEntry &entry = entries[i];
+        Block *block = blocks[i];
+        if(unlikely(0==block)) continue;
+        block->prev = (0<=entry.prev) ? blocks[entry.prev] : 0;
+        gBlockMap[entry.hash.v] = block;
+    }
+
+    gMaxHeight = header->maxHeight;
+    gMaxBlock = (0<=header->maxBlock) ? blocks[header->maxBlock] : 0;
+
+    for(uint64_t i=0; i<header->nbMaps; ++i)
+        mapVec[i].scanEnd = dropped[i] ? 0 : maps[i].scanEnd;
+
+    // Heights and links may go through dropped blocks: work them all out again once the rescan is done
+    if(unlikely(relink)) {
+        auto e = gBlockMap.end();
+        auto i = gBlockMap.begin();
+        while(i!=e) {
+            Block *block = (i++)->second;
+            block->height = block->data ? -1 : 0;
+            block->prev = 0;
+            block->next = 0;
+        }
+        gMaxHeight = 0;
+        gMaxBlock = 0;
+        gBlockIndexRelink = true;
+    }
+
+    info("loaded %" PRIu64 " blocks from block index cache", header->nbBlocks);
+    return (0!=gNullBlock);
+}
+
+static void saveBlockIndex()
+{
+    std::string fileName = blockIndexFileName();
+    if(0==fileName.size()) return;
+
+    typedef std::pair<const Block*, Hash256> BlockHash;
+    std::vector<BlockHash> blocks;
+    blocks.reserve(gBlockMap.size());
+
+    auto e = gBlockMap.end();
+    auto i = gBlockMap.begin();
+    while(i!=e) {
+        blocks.push_back(BlockHash(i->second, i->first));
+        ++i;
+    }
+    std::sort(blocks.begin(), blocks.end());
+
+    auto indexOf = [&](const Block *block) -> int64_t {
+        if(0==block) return -1;
+        auto j = std::lower_bound(blocks.begin(), blocks.end(), BlockHash(block, (Hash256)0));
+        return j - blocks.begin();
+    };
+
+    std::string tmpName = fileName + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) {
+        warning("couldn't open %s for writing (%s)", tmpName.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = true;
+    std::vector<BlockIndexMap> maps(mapVec.size());
+    for(size_t j=0; ok && j<mapVec.size(); ++j) {
+
+        const Map &map = mapVec[j];
+        if(sizeof(BlockIndexMap::name)<=map.name.size()) {
+            warning("block chain file name %s too long, not caching block index", map.name.c_str());
+            ok = false;
+            break;
+        }
+
+        BlockIndexMap &cached = maps[j];
+        memset(&cached, 0, sizeof(cached));
+        strcpy(cached.name, map.name.c_str());
+        cached.size = map.size;
+        cached.mtime = map.mtime;
+        cached.scanEnd = map.scanEnd;
+    }
+
+    std::vector<BlockIndexEntry> entries(blocks.size());
+    for(size_t j=0; ok && j<blocks.size(); ++j) {
+
+        const Block *block = blocks[j].first;
+
+        BlockIndexEntry &entry = entries[j];
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.hash.v, blocks[j].second, kSHA256ByteSize);
+        entry.mapIndex = block->mapIndex;
+        entry.offset = block->data ? (block->data - mapVec[block->mapIndex].p) : 0;
+        entry.height = block->height;
+        entry.prev = indexOf(block->prev);
+    }
+
+    BlockIndexHeader header;
+    header.magic = kBlockIndexMagic;
+    header.nbMaps = maps.size();
+    header.nbBlocks = entries.size();
+    header.maxBlock = indexOf(gMaxBlock);
+    header.maxHeight = gMaxHeight;
+    header.checksum = blockIndexChecksum(maps.data(), maps.size(), entries.data(), entries.size());
+
+    ok = ok && (
+        1==fwrite(&header, sizeof(header), 1, f)                                                            &&
+        (0==maps.size() || 1==fwrite(maps.data(), maps.size()*sizeof(BlockIndexMap), 1, f))                 &&
+        (0==entries.size() || 1==fwrite(entries.data(), entries.size()*sizeof(BlockIndexEntry), 1, f))
+    );
+    ok = (0==fclose(f)) && ok;
+    if(ok) ok = (0==rename(tmpName.c_str(), fileName.c_str()));
+    if(!ok) {
+        warning("failed to write block index cache %s (%s)", fileName.c_str(), strerror(errno));
+        unlink(tmpName.c_str());
+    }
 }
 
 static void firstPass()
 {
-    buildNullBlock();
+    bool cached = loadBlockIndex();
+    if(!cached) buildNullBlock();
+
+    size_t nbCached = gBlockMap.size();
     buildAllBlocks();
-    linkAllBlocks();
+
+    bool grew = (nbCached!=gBlockMap.size());
+    if(!cached || grew || gBlockIndexRelink) linkAllBlocks();
+    if(!cached || grew || gBlockIndexStale) saveBlockIndex();
 }
 
 static void secondPass()
 {
     findLongestChain();
+
+    if(gNeedTXMap) initTXMap();
+    if(gNeedTXHash) {
+        loadTXHashes();
+        atexit(saveTXHashes);
+    }
+
     parseLongestChain();
+    reportStalls();
+
+    if(gNeedTXMap) {
+        info(
+            "%" PRIu64 " transactions with unspent outputs left in TX map (%.2f MB)",
+            gTXMap.nbEntries,
+            gTXMap.memSize()*1e-6
+        );
+    }
+    gBlockMap.report("block map");
+    if(gAddrDict) gAddrDict->ids.report("address dictionary");
     gCallback->wrapup();
 }
 
@@ -623,6 +2601,20 @@ static void cleanMaps()
         if(r<0) sysErr("failed to unmap block chain file %s", map.name.c_str());
 
     }
+
+    auto ue = gUndoMaps.end();
+    auto ui = gUndoMaps.begin();
+    while(ui!=ue) {
+
+        const UndoMap &undoMap = *(ui++);
+        if(0==undoMap.p) continue;
+
+        int r = munmap((void*)undoMap.p, undoMap.size);
+        if(r<0) sysErr("failed to unmap undo file %s", undoMap.name.c_str());
+
+        r = close(undoMap.fd);
+        if(r<0) sysErr("failed to close undo file %s", undoMap.name.c_str());
+    }
 }
 
 int main(
@@ -634,6 +2626,7 @@ int main(
 
         initCallback(argc, argv);
         mapBlockChainFiles();
+        initCaches();
         initHashtables();
         firstPass();
         secondPass();
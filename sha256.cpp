@@ -1,7 +1,14 @@
-
 #include <sha256.h>
 #include "openssl/sha.h"
 
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+    #define X86
+#endif
+
 void sha256(
     uint8_t       *result,
     const uint8_t *data,
@@ -14,3 +21,167 @@ void sha256(
     SHA256_Final(result, &sha256);
 }
 
+typedef void (*SHA256Many)(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n,
+    bool                 twice
+);
+
+typedef void (*SHA256Twice80Many)(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+);
+
+static void sha256ManyOpenSSL(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n,
+    bool                 twice
+)
+{
+    for(size_t i=0; i<n; ++i) {
+        sha256(results[i], data[i], sizes[i]);
+        if(twice) sha256(results[i], results[i], kSHA256ByteSize);
+    }
+}
+
+static void sha256Twice80OpenSSL(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+)
+{
+    for(size_t i=0; i<n; ++i) {
+        sha256(results[i], headers[i], 80);
+        sha256(results[i], results[i], kSHA256ByteSize);
+    }
+}
+
+#if defined(X86)
+
+    // Engines, each in its own file compiled for its instruction set (see Makefile)
+    void sha256ManyAVX2(uint8_t *const *results, const uint8_t *const *data, const size_t *sizes, size_t n, bool twice);
+    void sha256ManySHANI(uint8_t *const *results, const uint8_t *const *data, const size_t *sizes, size_t n, bool twice);
+    void sha256ManyAVX512(uint8_t *const *results, const uint8_t *const *data, const size_t *sizes, size_t n, bool twice);
+    void sha256Twice80AVX2(uint8_t *const *results, const uint8_t *const *headers, size_t n);
+    void sha256Twice80SHANI(uint8_t *const *results, const uint8_t *const *headers, size_t n);
+    void sha256Twice80AVX512(uint8_t *const *results, const uint8_t *const *headers, size_t n);
+
+    // Register state the OS saves on context switches (XCR0)
+    static uint64_t osSavedState()
+    {
+        uint32_t a, b, c, d;
+        if(!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+        if(0==(c & bit_OSXSAVE)) return 0;
+
+        uint32_t lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return (((uint64_t)hi)<<32) | lo;
+    }
+
+#endif
+
+struct SHA256Engine
+{
+    const char        *name;
+    SHA256Many        hash;
+    SHA256Twice80Many hash80;
+    SHA256Twice80Many hash80One;      // lone headers: a 16 lane pass for a single one would be wasteful
+    bool              supported;
+};
+
+static SHA256Engine pickEngine()
+{
+    SHA256Engine engines[] = {
+        #if defined(X86)
+            { "avx512",  sha256ManyAVX512,  sha256Twice80AVX512,  sha256Twice80OpenSSL, false },
+            { "shani",   sha256ManySHANI,   sha256Twice80SHANI,   sha256Twice80SHANI,   false },
+            { "avx2",    sha256ManyAVX2,    sha256Twice80AVX2,    sha256Twice80OpenSSL, false },
+        #endif
+            { "openssl", sha256ManyOpenSSL, sha256Twice80OpenSSL, sha256Twice80OpenSSL, true  },
+    };
+    size_t nbEngines = sizeof(engines)/sizeof(engines[0]);
+
+    #if defined(X86)
+        uint32_t a, b, c, d;
+        uint32_t c1 = 0, b7 = 0;
+        if(__get_cpuid(1, &a, &b, &c, &d)) c1 = c;
+        if(__get_cpuid_count(7, 0, &a, &b, &c, &d)) b7 = b;
+
+        uint64_t xcr0 = osSavedState();
+        bool ymm = (0x06==(xcr0 & 0x06));
+        bool zmm = (0xE6==(xcr0 & 0xE6));
+
+        engines[0].supported = zmm && 0!=(b7 & bit_AVX512F);
+        engines[1].supported = 0!=(b7 & bit_SHA) && 0!=(c1 & bit_SSE4_1) && 0!=(c1 & bit_SSSE3);
+        engines[2].supported = ymm && 0!=(b7 & bit_AVX2);
+        if(engines[1].supported) {
+            engines[0].hash80One = sha256Twice80SHANI;
+            engines[2].hash80One = sha256Twice80SHANI;
+        }
+    #endif
+
+    // SHA256=<name> forces an engine, e.g. to compare them
+    const char *forced = getenv("SHA256");
+    for(size_t i=0; forced && i<nbEngines; ++i) {
+        if(engines[i].supported && 0==strcmp(forced, engines[i].name)) return engines[i];
+    }
+
+    for(size_t i=0; i<nbEngines; ++i) {
+        if(engines[i].supported) return engines[i];
+    }
+    return engines[nbEngines - 1];
+}
+
+static const SHA256Engine &getEngine()
+{
+    static SHA256Engine engine = pickEngine();
+    return engine;
+}
+
+void sha256TwiceMany(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n
+)
+{
+    getEngine().hash(results, data, sizes, n, true);
+}
+
+void sha256Many(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n
+)
+{
+    getEngine().hash(results, data, sizes, n, false);
+}
+
+void sha256Twice80Many(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+)
+{
+    getEngine().hash80(results, headers, n);
+}
+
+void sha256Twice80(
+    uint8_t       *result,
+    const uint8_t *header
+)
+{
+    getEngine().hash80One(&result, &header, 1);
+}
+
+const char *sha256EngineName()
+{
+    return getEngine().name;
+}
+
@@ -10,5 +10,39 @@
         size_t        len
     );
 
+    // sha256(sha256(data[i])) into results[i] for n independent messages. Picks
+    // the fastest engine the CPU has at runtime (see sha256EngineName) and hashes
+    // several messages per call when it's a multi-buffer one
+    void sha256TwiceMany(
+        uint8_t       *const *results,
+        const uint8_t *const *data,
+        const size_t         *sizes,
+        size_t               n
+    );
+
+    // sha256(data[i]) into results[i], same engines
+    void sha256Many(
+        uint8_t       *const *results,
+        const uint8_t *const *data,
+        const size_t         *sizes,
+        size_t               n
+    );
+
+    // Double SHA-256 of 80 byte block headers, with the padding of all blocks but the first fixed
+    void sha256Twice80Many(
+        uint8_t       *const *results,
+        const uint8_t *const *headers,
+        size_t               n
+    );
+
+    // One 80 byte block header
+    void sha256Twice80(
+        uint8_t       *result,
+        const uint8_t *header
+    );
+
+    // Name of the engine sha256TwiceMany uses: "avx512", "shani", "avx2" or "openssl"
+    const char *sha256EngineName();
+
 #endif // __SHA256_H__
 
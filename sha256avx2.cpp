@@ -0,0 +1,46 @@
+
+// 8 way multi-buffer SHA-256 -- compiled with -mavx2, only called when the CPU has it
+
+#include <immintrin.h>
+#include <sha256lanes.h>
+
+namespace {
+
+    struct AVX2
+    {
+        enum { kWidth = 8 };
+        typedef __m256i V;
+
+        static inline V    load(const uint32_t *p)  { return _mm256_load_si256((const V*)p);                         }
+        static inline void store(uint32_t *p, V x)  { _mm256_store_si256((V*)p, x);                                  }
+        static inline V    set1(uint32_t k)         { return _mm256_set1_epi32(k);                                   }
+        static inline V    add(V x, V y)            { return _mm256_add_epi32(x, y);                                 }
+        static inline V    xor3(V x, V y, V z)      { return _mm256_xor_si256(x, _mm256_xor_si256(y, z));            }
+        static inline V    ch(V x, V y, V z)        { return _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z))); }
+        static inline V    maj(V x, V y, V z)       { return _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y))); }
+
+        template<int n> static inline V ror(V x)    { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+        template<int n> static inline V shr(V x)    { return _mm256_srli_epi32(x, n);                                }
+    };
+}
+
+void sha256ManyAVX2(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n,
+    bool                 twice
+)
+{
+    sha256Lanes<AVX2>(results, data, sizes, n, twice);
+}
+
+void sha256Twice80AVX2(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+)
+{
+    sha256Twice80Lanes<AVX2>(results, headers, n);
+}
+
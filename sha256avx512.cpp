@@ -0,0 +1,50 @@
+
+// 16 way multi-buffer SHA-256 -- compiled with -mavx512f, only called when the CPU has it
+
+#include <immintrin.h>
+#include <sha256lanes.h>
+
+// Some gcc versions see the "undefined" passthrough of the unmasked AVX-512 intrinsics as uninitialized
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+namespace {
+
+    struct AVX512
+    {
+        enum { kWidth = 16 };
+        typedef __m512i V;
+
+        // Ternary logic immediates: truth tables of x^y^z, x?y:z and majority(x, y, z)
+        static inline V    load(const uint32_t *p)  { return _mm512_load_si512((const void*)p);      }
+        static inline void store(uint32_t *p, V x)  { _mm512_store_si512((void*)p, x);               }
+        static inline V    set1(uint32_t k)         { return _mm512_set1_epi32(k);                   }
+        static inline V    add(V x, V y)            { return _mm512_add_epi32(x, y);                 }
+        static inline V    xor3(V x, V y, V z)      { return _mm512_ternarylogic_epi32(x, y, z, 0x96); }
+        static inline V    ch(V x, V y, V z)        { return _mm512_ternarylogic_epi32(x, y, z, 0xCA); }
+        static inline V    maj(V x, V y, V z)       { return _mm512_ternarylogic_epi32(x, y, z, 0xE8); }
+
+        template<int n> static inline V ror(V x)    { return _mm512_ror_epi32(x, n);                 }
+        template<int n> static inline V shr(V x)    { return _mm512_srli_epi32(x, n);                }
+    };
+}
+
+void sha256ManyAVX512(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n,
+    bool                 twice
+)
+{
+    sha256Lanes<AVX512>(results, data, sizes, n, twice);
+}
+
+void sha256Twice80AVX512(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+)
+{
+    sha256Twice80Lanes<AVX512>(results, headers, n);
+}
+
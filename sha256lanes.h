@@ -0,0 +1,268 @@
+#ifndef __SHA256LANES_H__
+    #define __SHA256LANES_H__
+
+    // Multi-buffer SHA-256: each SIMD lane hashes its own message, and a lane
+    // that's done picks up the next one. Included by the engines (sha256avx2.cpp, ...),
+    // which compile it with their own target flags: keep everything in here internal.
+
+    #include <string.h>
+    #include <sha256.h>
+
+    namespace {
+
+        static const uint32_t kSHA256K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        static const uint32_t kSHA256IV[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+
+        static inline uint32_t loadBE32(const uint8_t *p)          { uint32_t x; memcpy(&x, p, 4); return __builtin_bswap32(x); }
+        static inline void     storeBE32(uint8_t *p, uint32_t x)   { x = __builtin_bswap32(x); memcpy(p, &x, 4);               }
+
+        // Padding of a message of size bytes: its last (size % 64) bytes followed by
+        // 0x80, zeros and the bit length. Returns the number of 64 byte blocks (1 or 2)
+        static inline size_t padTail(
+            uint8_t       *buf,     // 128 bytes
+            const uint8_t *data,
+            size_t        size
+        )
+        {
+            size_t r = size % 64;
+            size_t nbBlocks = (r + 9<=64) ? 1 : 2;
+            memset(buf, 0, 64*nbBlocks);
+            memcpy(buf, data + size - r, r);
+            buf[r] = 0x80;
+
+            uint64_t bits = 8*(uint64_t)size;
+            for(int i=0; i<8; ++i) buf[64*nbBlocks - 1 - i] = (uint8_t)(bits>>(8*i));
+            return nbBlocks;
+        }
+
+        // Second pass of sha256Twice: the 32 byte digest of the first one, padded
+        static inline void padDigest(
+            uint8_t        *buf,    // 64 bytes
+            const uint32_t *state
+        )
+        {
+            for(int i=0; i<8; ++i) storeBE32(buf + 4*i, state[i]);
+            memset(32 + buf, 0, 32);
+            buf[32] = 0x80;
+            buf[62] = 0x01;         // 256 bits
+        }
+
+        // One 64 byte block of each lane, E provides the SIMD ops (see sha256avx2.cpp)
+        template<typename E>
+        static inline void compressLanes(
+            typename E::V       *s,
+            const typename E::V *block
+        )
+        {
+            typedef typename E::V V;
+
+            #define S0(x) E::xor3(E::template ror<2>(x), E::template ror<13>(x), E::template ror<22>(x))
+            #define S1(x) E::xor3(E::template ror<6>(x), E::template ror<11>(x), E::template ror<25>(x))
+            #define s0(x) E::xor3(E::template ror<7>(x), E::template ror<18>(x), E::template shr<3>(x))
+            #define s1(x) E::xor3(E::template ror<17>(x), E::template ror<19>(x), E::template shr<10>(x))
+
+                V w[16];
+                V a = s[0], b = s[1], c = s[2], d = s[3];
+                V e = s[4], f = s[5], g = s[6], h = s[7];
+
+                #pragma GCC unroll 64
+                for(int i=0; i<64; ++i) {
+
+                    V wi;
+                    if(i<16) wi = w[i] = block[i];
+                    else {
+                        V x = E::add(s1(w[(i - 2) & 15]), w[(i - 7) & 15]);
+                        V y = E::add(s0(w[(i - 15) & 15]), w[i & 15]);
+                        wi = w[i & 15] = E::add(x, y);
+                    }
+
+                    V t1 = E::add(E::add(h, S1(e)), E::add(E::ch(e, f, g), E::add(E::set1(kSHA256K[i]), wi)));
+                    V t2 = E::add(S0(a), E::maj(a, b, c));
+                    h = g;
+                    g = f;
+                    f = e;
+                    e = E::add(d, t1);
+                    d = c;
+                    c = b;
+                    b = a;
+                    a = E::add(t1, t2);
+                }
+
+                s[0] = E::add(s[0], a); s[1] = E::add(s[1], b); s[2] = E::add(s[2], c); s[3] = E::add(s[3], d);
+                s[4] = E::add(s[4], e); s[5] = E::add(s[5], f); s[6] = E::add(s[6], g); s[7] = E::add(s[7], h);
+
+            #undef s1
+            #undef s0
+            #undef S1
+            #undef S0
+        }
+
+        template<typename E>
+        static void sha256Lanes(
+            uint8_t       *const *results,
+            const uint8_t *const *data,
+            const size_t         *sizes,
+            size_t               n,
+            bool                 twice
+        )
+        {
+            enum { kWidth = E::kWidth };
+            typedef typename E::V V;
+
+            struct Lane
+            {
+                const uint8_t *p;           // next full block of the message
+                size_t        nbFull;
+                const uint8_t *tail;        // then these padded ones
+                size_t        nbTail;
+                size_t        msg;
+                bool          second;       // hashing the first digest
+                bool          busy;
+                uint8_t       buf[128];
+            };
+
+            static const uint8_t idle[64] = { 0 };
+            Lane lanes[kWidth];
+            uint32_t state[8][kWidth] __attribute__((aligned(64)));
+            uint32_t words[16][kWidth] __attribute__((aligned(64)));
+
+            size_t next = 0;
+            size_t nbBusy = 0;
+            auto feed = [&](size_t j) {
+                Lane &lane = lanes[j];
+                lane.busy = (next<n);
+                if(!lane.busy) return;
+
+                size_t size = sizes[next];
+                lane.msg = next;
+                lane.p = data[next];
+                lane.nbFull = size/64;
+                lane.nbTail = padTail(lane.buf, data[next], size);
+                lane.tail = lane.buf;
+                lane.second = false;
+                for(int k=0; k<8; ++k) state[k][j] = kSHA256IV[k];
+                ++nbBusy;
+                ++next;
+            };
+
+            for(size_t j=0; j<kWidth; ++j) feed(j);
+            while(0<nbBusy) {
+
+                for(size_t j=0; j<kWidth; ++j) {
+
+                    Lane &lane = lanes[j];
+                    const uint8_t *block = idle;
+                    if(lane.busy) {
+                        if(0<lane.nbFull) {
+                            block = lane.p;
+                            lane.p += 64;
+                            --lane.nbFull;
+                        } else {
+                            block = lane.tail;
+                            lane.tail += 64;
+                            --lane.nbTail;
+                        }
+                    }
+                    for(int k=0; k<16; ++k) words[k][j] = loadBE32(block + 4*k);
+                }
+
+                V s[8], w[16];
+                for(int k=0; k<8; ++k) s[k] = E::load(state[k]);
+                for(int k=0; k<16; ++k) w[k] = E::load(words[k]);
+                compressLanes<E>(s, w);
+                for(int k=0; k<8; ++k) E::store(state[k], s[k]);
+
+                for(size_t j=0; j<kWidth; ++j) {
+
+                    Lane &lane = lanes[j];
+                    if(!lane.busy || 0<lane.nbFull || 0<lane.nbTail) continue;
+
+                    uint32_t digest[8];
+                    for(int k=0; k<8; ++k) digest[k] = state[k][j];
+
+                    if(twice && !lane.second) {
+                        padDigest(lane.buf, digest);
+                        lane.tail = lane.buf;
+                        lane.nbTail = 1;
+                        lane.second = true;
+                        for(int k=0; k<8; ++k) state[k][j] = kSHA256IV[k];
+                        continue;
+                    }
+
+                    for(int k=0; k<8; ++k) storeBE32(results[lane.msg] + 4*k, digest[k]);
+                    --nbBusy;
+                    feed(j);
+                }
+            }
+        }
+
+        // Same for 80 byte block headers: every header takes exactly three blocks and
+        // the padding of the last two is fixed, so lanes move in lockstep
+        template<typename E>
+        static void sha256Twice80Lanes(
+            uint8_t       *const *results,
+            const uint8_t *const *headers,
+            size_t               n
+        )
+        {
+            enum { kWidth = E::kWidth };
+            typedef typename E::V V;
+
+            uint32_t words[16][kWidth] __attribute__((aligned(64)));
+            uint32_t state[8][kWidth] __attribute__((aligned(64)));
+            memset(words, 0, sizeof(words));
+
+            for(size_t i=0; i<n; i+=kWidth) {
+
+                size_t m = n - i;
+                if(kWidth<m) m = kWidth;
+                const uint8_t *const *h = headers + i;
+
+                V s[8], w[16];
+                for(size_t j=0; j<m; ++j) {
+                    for(int k=0; k<16; ++k) words[k][j] = loadBE32(h[j] + 4*k);
+                }
+                for(int k=0; k<8; ++k) s[k] = E::set1(kSHA256IV[k]);
+                for(int k=0; k<16; ++k) w[k] = E::load(words[k]);
+                compressLanes<E>(s, w);
+
+                // Last 16 bytes, 0x80, zeros, 640 bits
+                for(size_t j=0; j<m; ++j) {
+                    for(int k=0; k<4; ++k) words[k][j] = loadBE32(h[j] + 64 + 4*k);
+                }
+                for(int k=0; k<4; ++k) w[k] = E::load(words[k]);
+                w[4] = E::set1(0x80000000);
+                for(int k=5; k<15; ++k) w[k] = E::set1(0);
+                w[15] = E::set1(640);
+                compressLanes<E>(s, w);
+
+                // Digest, 0x80, zeros, 256 bits
+                for(int k=0; k<8; ++k) w[k] = s[k];
+                w[8] = E::set1(0x80000000);
+                for(int k=9; k<15; ++k) w[k] = E::set1(0);
+                w[15] = E::set1(256);
+                for(int k=0; k<8; ++k) s[k] = E::set1(kSHA256IV[k]);
+                compressLanes<E>(s, w);
+
+                for(int k=0; k<8; ++k) E::store(state[k], s[k]);
+                for(size_t j=0; j<m; ++j) {
+                    for(int k=0; k<8; ++k) storeBE32(results[i + j] + 4*k, state[k][j]);
+                }
+            }
+        }
+    }
+
+#endif // __SHA256LANES_H__
+
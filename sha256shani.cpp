@@ -0,0 +1,123 @@
+
+// SHA-256 on the SHA extensions -- compiled with -msha -msse4.1, only called when the CPU has them
+
+#include <immintrin.h>
+#include <sha256lanes.h>
+
+namespace {
+
+    // Four rounds, msg holds the four schedule words already added to their round constants
+    static inline void quadRound(
+        __m128i &abef,
+        __m128i &cdgh,
+        __m128i msg
+    )
+    {
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+    }
+
+    static void compress(
+        uint32_t      *state,
+        const uint8_t *block
+    )
+    {
+        const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+        // abcd, efgh -> abef, cdgh as the rounds instruction wants them
+        __m128i t0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(0 + state)), 0xB1);
+        __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(4 + state)), 0x1B);
+        __m128i abef = _mm_alignr_epi8(t0, t1, 8);
+        __m128i cdgh = _mm_blend_epi16(t1, t0, 0xF0);
+        __m128i abef0 = abef;
+        __m128i cdgh0 = cdgh;
+
+        __m128i m[4];
+        for(int g=0; g<4; ++g) m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16*g)), mask);
+
+        #pragma GCC unroll 16
+        for(int g=0; g<16; ++g) {
+
+            // Slots hold the schedule words of groups g-4, g-3, g-2 and g-1
+            if(4<=g) {
+                __m128i x = _mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+                m[g & 3] = _mm_sha256msg2_epu32(x, m[(g + 3) & 3]);
+            }
+
+            __m128i k = _mm_loadu_si128((const __m128i*)(kSHA256K + 4*g));
+            quadRound(abef, cdgh, _mm_add_epi32(m[g & 3], k));
+        }
+
+        abef = _mm_add_epi32(abef, abef0);
+        cdgh = _mm_add_epi32(cdgh, cdgh0);
+
+        t0 = _mm_shuffle_epi32(abef, 0x1B);
+        t1 = _mm_shuffle_epi32(cdgh, 0xB1);
+        _mm_storeu_si128((__m128i*)(0 + state), _mm_blend_epi16(t0, t1, 0xF0));
+        _mm_storeu_si128((__m128i*)(4 + state), _mm_alignr_epi8(t1, t0, 8));
+    }
+}
+
+void sha256ManySHANI(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n,
+    bool                 twice
+)
+{
+    // One message at a time: the rounds instruction is fast enough that interleaving doesn't pay much
+    for(size_t i=0; i<n; ++i) {
+
+        uint32_t state[8];
+        memcpy(state, kSHA256IV, sizeof(state));
+
+        const uint8_t *p = data[i];
+        size_t nbFull = sizes[i]/64;
+        while(nbFull--) {
+            compress(state, p);
+            p += 64;
+        }
+
+        uint8_t buf[128];
+        size_t nbTail = padTail(buf, data[i], sizes[i]);
+        for(size_t j=0; j<nbTail; ++j) compress(state, buf + 64*j);
+
+        if(twice) {
+            padDigest(buf, state);
+            memcpy(state, kSHA256IV, sizeof(state));
+            compress(state, buf);
+        }
+        for(int k=0; k<8; ++k) storeBE32(results[i] + 4*k, state[k]);
+    }
+}
+
+void sha256Twice80SHANI(
+    uint8_t       *const *results,
+    const uint8_t *const *headers,
+    size_t               n
+)
+{
+    // Last 16 bytes of the header go in front, the rest is fixed: 0x80, zeros, 640 bits
+    uint8_t tail[64] = { 0 };
+    tail[16] = 0x80;
+    tail[62] = 0x02;
+    tail[63] = 0x80;
+
+    for(size_t i=0; i<n; ++i) {
+
+        uint32_t state[8];
+        memcpy(state, kSHA256IV, sizeof(state));
+        compress(state, headers[i]);
+        memcpy(tail, 64 + headers[i], 16);
+        compress(state, tail);
+
+        uint8_t buf[64];
+        padDigest(buf, state);
+        memcpy(state, kSHA256IV, sizeof(state));
+        compress(state, buf);
+        for(int k=0; k<8; ++k) storeBE32(results[i] + 4*k, state[k]);
+    }
+}
+
@@ -0,0 +1,207 @@
+
+#include <store.h>
+#include <errlog.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum { kStoreIndexMagic = 0x3130304e48434250ULL }; // "BPCHN001"
+
+// Well within the 4 GB a TX locator can point into
+static const uint64_t kStoreFileSize = 1ULL<<30;
+
+const std::string &getStoreDir()
+{
+    static bool initialized = false;
+    static std::string storeDir;
+    if(unlikely(!initialized)) {
+        initialized = true;
+
+        const char *dir = getenv("CHAINSTORE");
+        if(0!=dir && 0!=dir[0]) {
+            storeDir = dir;
+            if('/'!=storeDir[storeDir.size()-1]) storeDir += '/';
+        }
+    }
+    return storeDir;
+}
+
+std::string storeFileName(
+    const std::string &dir,
+    size_t            fileIndex
+)
+{
+    char buf[64];
+    sprintf(buf, "chain%05d.dat", (int)fileIndex);
+    return dir + std::string(buf);
+}
+
+static std::string storeIndexName(
+    const std::string &dir
+)
+{
+    return dir + "chain.idx";
+}
+
+static uint64_t indexChecksum(
+    const uint64_t        *fileSizes,
+    uint64_t              nbFiles,
+    const StoreIndexEntry *entries,
+    uint64_t              nbBlocks
+)
+{
+    return
+        checksum64(fileSizes, nbFiles*sizeof(uint64_t))             ^
+        checksum64(entries, nbBlocks*sizeof(StoreIndexEntry))
+    ;
+}
+
+StoreWriter::StoreWriter(
+    const std::string &d
+)
+:   dir(d),
+    file(0),
+    fileSize(0)
+{
+    if('/'!=dir[dir.size()-1]) dir += '/';
+
+    int r = mkdir(dir.c_str(), 0755);
+    if(r<0 && EEXIST!=errno) sysErrFatal("couldn't create chain store directory %s", dir.c_str());
+
+    // Whatever store was there is gone from now on
+    unlink(storeIndexName(dir).c_str());
+}
+
+StoreWriter::~StoreWriter()
+{
+    if(file) fclose(file);
+}
+
+void StoreWriter::add(
+    const uint8_t *hash,
+    const uint8_t *frame,
+    uint64_t      size
+)
+{
+    if(0==file || kStoreFileSize<(fileSize + size)) {
+
+        if(file) {
+            if(0!=fclose(file)) sysErrFatal("failed to write chain store file %s", storeFileName(dir, fileSizes.size() - 1).c_str());
+            file = 0;
+        }
+
+        std::string name = storeFileName(dir, fileSizes.size());
+        file = fopen(name.c_str(), "w");
+        if(0==file) sysErrFatal("couldn't open %s for writing", name.c_str());
+
+        fileSizes.push_back(0);
+        fileSize = 0;
+    }
+
+    StoreIndexEntry entry;
+    memcpy(entry.hash.v, hash, kSHA256ByteSize);
+    entry.fileIndex = fileSizes.size() - 1;
+    entry.offset = fileSize + 8;
+    entries.push_back(entry);
+
+    if(1!=fwrite(frame, size, 1, file)) {
+        sysErrFatal("failed to write chain store file %s", storeFileName(dir, fileSizes.size() - 1).c_str());
+    }
+
+    fileSize += size;
+    fileSizes.back() = fileSize;
+}
+
+void StoreWriter::finish()
+{
+    if(file) {
+        if(0!=fclose(file)) sysErrFatal("failed to write chain store file %s", storeFileName(dir, fileSizes.size() - 1).c_str());
+        file = 0;
+    }
+
+    StoreIndexHeader header;
+    header.magic = kStoreIndexMagic;
+    header.nbFiles = fileSizes.size();
+    header.nbBlocks = entries.size();
+    header.checksum = indexChecksum(fileSizes.data(), fileSizes.size(), entries.data(), entries.size());
+
+    std::string fileName = storeIndexName(dir);
+    std::string tmpName = fileName + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) sysErrFatal("couldn't open %s for writing", tmpName.c_str());
+
+    bool ok = (
+        1==fwrite(&header, sizeof(header), 1, f)                                                                &&
+        (0==fileSizes.size() || 1==fwrite(fileSizes.data(), fileSizes.size()*sizeof(uint64_t), 1, f))          &&
+        (0==entries.size() || 1==fwrite(entries.data(), entries.size()*sizeof(StoreIndexEntry), 1, f))
+    );
+    ok = (0==fclose(f)) && ok;
+    if(ok) ok = (0==rename(tmpName.c_str(), fileName.c_str()));
+    if(!ok) {
+        unlink(tmpName.c_str());
+        sysErrFatal("failed to write chain store index %s", fileName.c_str());
+    }
+}
+
+StoreIndex::~StoreIndex()
+{
+    if(header) munmap((void*)header, mapSize);
+}
+
+bool StoreIndex::load(
+    const std::string &dir
+)
+{
+    std::string fileName = storeIndexName(dir);
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(fd, &statBuf);
+    if(r<0 || statBuf.st_size<(off_t)sizeof(StoreIndexHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = statBuf.st_size;
+    void *pMap = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(((void*)-1)==pMap) {
+        sysErr("failed to mmap chain store index %s", fileName.c_str());
+        return false;
+    }
+
+    const StoreIndexHeader *h = (const StoreIndexHeader*)pMap;
+    const uint64_t *sizes = (const uint64_t*)(h + 1);
+    const StoreIndexEntry *e = (const StoreIndexEntry*)(sizes + h->nbFiles);
+
+    bool ok = (
+        kStoreIndexMagic==h->magic                                          &&
+        h->nbFiles<=size                                                    &&
+        h->nbBlocks<=size                                                   &&
+        size==(
+            sizeof(StoreIndexHeader)                    +
+            h->nbFiles*sizeof(uint64_t)                 +
+            h->nbBlocks*sizeof(StoreIndexEntry)
+        )                                                                   &&
+        h->checksum==indexChecksum(sizes, h->nbFiles, e, h->nbBlocks)
+    );
+
+    if(!ok) {
+        warning("chain store index %s is corrupt", fileName.c_str());
+        munmap(pMap, size);
+        return false;
+    }
+
+    header = h;
+    fileSizes = sizes;
+    entries = e;
+    mapSize = size;
+    return true;
+}
+
@@ -0,0 +1,85 @@
+#ifndef __STORE_H__
+    #define __STORE_H__
+
+    #include <string>
+    #include <vector>
+    #include <stdio.h>
+    #include <util.h>
+    #include <common.h>
+
+    // Chain ordered block store, written by the compact command.
+    //
+    // The blocks of the longest chain are laid out in height order over chainNNNNN.dat files, framed just
+    // like blk*.dat (magic, size, block), so the parser reads them like any other block chain file and its
+    // second pass turns into sequential reads. chain.idx holds the size of every file and the hash and
+    // location of every block, so the first pass doesn't have to scan or hash anything either.
+    struct StoreIndexHeader
+    {
+        uint64_t magic;
+        uint64_t nbFiles;
+        uint64_t nbBlocks;
+        uint64_t checksum;      // of the file sizes and entries that follow
+    };
+
+    struct StoreIndexEntry
+    {
+        uint256_t hash;
+        uint64_t  fileIndex;
+        uint64_t  offset;       // of the block header, right past its framing
+    };
+
+    // Directory of the store the parser reads instead of blk files (CHAINSTORE), empty if none
+    const std::string &getStoreDir();
+
+    std::string storeFileName(
+        const std::string &dir,
+        size_t            fileIndex
+    );
+
+    struct StoreWriter
+    {
+        std::string                  dir;
+        FILE                         *file;
+        uint64_t                     fileSize;
+        std::vector<uint64_t>        fileSizes;
+        std::vector<StoreIndexEntry> entries;
+
+        StoreWriter(const std::string &dir);
+        ~StoreWriter();
+
+        void add(
+            const uint8_t *hash,
+            const uint8_t *frame,       // magic and size, followed by the block
+            uint64_t      size          // of the whole frame
+        );
+        void finish();                  // flushes the last file and writes the index
+
+    private:
+
+        StoreWriter(const StoreWriter &);
+        StoreWriter &operator=(const StoreWriter &);
+    };
+
+    struct StoreIndex
+    {
+        const StoreIndexHeader *header;
+        const uint64_t         *fileSizes;
+        const StoreIndexEntry  *entries;
+        uint64_t               mapSize;
+
+        StoreIndex() : header(0), fileSizes(0), entries(0), mapSize(0) {}
+        ~StoreIndex();
+
+        bool load(const std::string &dir);
+
+        uint64_t nbFiles()  const { return header ? header->nbFiles  : 0; }
+        uint64_t nbBlocks() const { return header ? header->nbBlocks : 0; }
+
+    private:
+
+        StoreIndex(const StoreIndex &);
+        StoreIndex &operator=(const StoreIndex &);
+    };
+
+#endif // __STORE_H__
+
@@ -0,0 +1,223 @@
+
+#include <txmap.h>
+#include <errlog.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+void TXMap::init(
+    uint64_t nbExpected,
+    Verifier       v,
+    bool           scripts,
+    const AddrDict *dict
+)
+{
+    free(slots);
+
+    // Keep the load factor around 0.7 -- linear probing degrades fast past that
+    capacity = 16 + (nbExpected*10)/7;
+    slots = (Slot*)calloc(capacity, sizeof(Slot));
+    if(0==slots) sysErrFatal("failed to allocate %" PRIu64 " bytes for TX map", memSize());
+
+    nbEntries = 0;
+    verifier = v;
+
+    outputOffsets.setEmptyKey(~0ULL);
+    outputOffsets.set_deleted_key(~1ULL);
+
+    keepScripts = scripts;
+    addrDict = dict;
+    scriptSize = 1 + (dict ? sizeof(uint32_t) : (size_t)kRIPEMD160ByteSize);
+    outputScripts.setEmptyKey(~0ULL);
+    outputScripts.set_deleted_key(~1ULL);
+}
+
+void TXMap::insert(
+    const uint8_t                 *hash,
+    uint64_t                      loc,
+    uint64_t                      nbUnspent,
+    const std::vector<uint32_t>   &offsets,
+    const std::vector<ScriptInfo> &scripts
+)
+{
+    if(unlikely(0==nbUnspent)) return;
+    if(unlikely(kCountMask<nbUnspent)) nbUnspent = kCountMask;
+
+    if(unlikely(kMinWideOutputs<=offsets.size())) {
+        size_t size = offsets.size()*sizeof(uint32_t);
+        uint32_t *table = (uint32_t*)malloc(sizeof(uint32_t) + size);
+        if(0==table) sysErrFatal("failed to allocate %" PRIu64 " bytes for output offsets", (uint64_t)(sizeof(uint32_t) + size));
+        table[0] = offsets.size();
+        memcpy(1 + table, &offsets[0], size);
+        outputOffsets[loc] = table;
+        loc |= kWide;
+    }
+
+    if(keepScripts && 0<scripts.size()) {
+        uint8_t *table = scriptArena.alloc(sizeof(uint32_t) + scripts.size()*scriptSize);
+        *(uint32_t*)table = scripts.size();
+
+        uint8_t *p = sizeof(uint32_t) + table;
+        auto e = scripts.end();
+        auto i = scripts.begin();
+        while(i!=e) {
+            const ScriptInfo &info = *(i++);
+            p[0] = (uint8_t)info.type;
+            if(addrDict) memcpy(1+p, &info.addrId, sizeof(uint32_t));
+            else memcpy(1+p, info.hash160, kRIPEMD160ByteSize);
+            p += scriptSize;
+        }
+        outputScripts[kLocMask & loc] = table;
+    }
+
+    loc |= (nbUnspent<<kCountShift);
+
+    if(unlikely((capacity*17)<=(nbEntries*20))) grow();
+
+    bool collision = false;
+    uint64_t key = keyOf(hash);
+    uint64_t i = bucketOf(key);
+    while(1) {
+
+        Slot *slot = slots + i;
+        if(0==slot->key) {
+            slot->key = key;
+            slot->loc = loc | (collision ? kCollision : 0);
+            ++nbEntries;
+            return;
+        }
+
+        if(unlikely(key==slot->key)) {
+
+            // Same TX seen again (e.g. the duplicated coinbases of BIP30): latest wins
+            if(verifier(kLocMask & slot->loc, hash)) {
+                if(kWide & slot->loc) freeOffsets(kLocMask & slot->loc);
+                if(keepScripts) freeScripts(kLocMask & slot->loc);
+                slot->loc = loc | (kCollision & slot->loc);
+                return;
+            }
+
+            slot->loc |= kCollision;
+            collision = true;
+        }
+
+        i = nextBucket(i);
+    }
+}
+
+void TXMap::erase(
+    Slot *slot
+)
+{
+    // Backward shift deletion: pull later members of the probe run into the hole
+    if(kWide & slot->loc) freeOffsets(kLocMask & slot->loc);
+    if(keepScripts) freeScripts(kLocMask & slot->loc);
+
+    uint64_t i = slot - slots;
+    uint64_t j = i;
+    while(1) {
+
+        j = nextBucket(j);
+        if(0==slots[j].key) break;
+
+        uint64_t k = bucketOf(slots[j].key);
+        bool stays = (i<=j) ? (i<k && k<=j) : (i<k || k<=j);
+        if(stays) continue;
+
+        slots[i] = slots[j];
+        i = j;
+    }
+
+    slots[i].key = 0;
+    slots[i].loc = 0;
+    --nbEntries;
+}
+
+void TXMap::freeOffsets(
+    uint64_t loc
+)
+{
+    OffsetMap::iterator i = outputOffsets.find(loc);
+    free(i->second);
+    outputOffsets.erase(i);
+}
+
+void TXMap::freeScripts(
+    uint64_t loc
+)
+{
+    ScriptMap::iterator i = outputScripts.find(loc);
+    if(outputScripts.end()==i) return;
+
+    uint8_t *table = i->second;
+    scriptArena.release(table, sizeof(uint32_t) + (*(uint32_t*)table)*scriptSize);
+    outputScripts.erase(i);
+}
+
+uint8_t *TXMap::ScriptArena::alloc(
+    uint64_t size
+)
+{
+    uint64_t c = (size + kGrain - 1)/kGrain;
+    if(unlikely(kNbClasses<c)) {
+        uint8_t *p = (uint8_t*)malloc(size);
+        if(0==p) sysErrFatal("failed to allocate %" PRIu64 " bytes for output scripts", size);
+        return p;
+    }
+
+    void *p = freeLists[c];
+    if(likely(0!=p)) {
+        freeLists[c] = *(void**)p;
+        return (uint8_t*)p;
+    }
+
+    size = c*kGrain;
+    if(unlikely(chunkLeft<size)) {
+        chunk = (uint8_t*)malloc(kChunkSize);
+        if(0==chunk) sysErrFatal("failed to allocate %d bytes for output scripts", (int)kChunkSize);
+        chunkLeft = kChunkSize;
+    }
+
+    p = chunk;
+    chunk += size;
+    chunkLeft -= size;
+    return (uint8_t*)p;
+}
+
+void TXMap::ScriptArena::release(
+    uint8_t  *p,
+    uint64_t size
+)
+{
+    uint64_t c = (size + kGrain - 1)/kGrain;
+    if(unlikely(kNbClasses<c)) {
+        free(p);
+        return;
+    }
+
+    *(void**)p = freeLists[c];
+    freeLists[c] = p;
+}
+
+void TXMap::grow()
+{
+    Slot *oldSlots = slots;
+    uint64_t oldCapacity = capacity;
+
+    capacity = 2*oldCapacity;
+    slots = (Slot*)calloc(capacity, sizeof(Slot));
+    if(0==slots) sysErrFatal("failed to allocate %" PRIu64 " bytes for TX map", memSize());
+
+    for(uint64_t j=0; j<oldCapacity; ++j) {
+
+        const Slot &old = oldSlots[j];
+        if(0==old.key) continue;
+
+        uint64_t i = bucketOf(old.key);
+        while(0!=slots[i].key) i = nextBucket(i);
+        slots[i] = old;
+    }
+
+    free(oldSlots);
+}
+
@@ -0,0 +1,237 @@
+#ifndef __TXMAP_H__
+    #define __TXMAP_H__
+
+    #include <util.h>
+    #include <common.h>
+    #include <sha256.h>
+    #include <addrdict.h>
+
+    #include <string.h>
+
+    // Compact open-addressing table mapping a TX hash to the place the TX lives in a block chain file.
+    //
+    // Each slot holds the first 8 bytes of the TX hash (the key) and a packed locator (map index + offset
+    // of the TX in that map). Two different hashes sharing a key are flagged as colliding, and a hit on a
+    // flagged slot is confirmed by re-hashing the TX found at the locator (see Verifier).
+    //
+    // The locator word also carries the number of still unspent outputs of the TX: once that drops to
+    // zero, the TX can never be referenced again and its slot is released.
+    //
+    // TXs with many outputs additionally get a table holding the offset of each output in the TX's map,
+    // so that resolving a spend doesn't require walking all the outputs that precede it.
+    //
+    // When asked to (keepScripts), each TX also gets its output scripts as solved at creation time, so
+    // that a spend hands the same result to callbacks instead of solving the upstream script again. Only
+    // the script type and the address id are kept (the hash160 itself when there's no address dictionary),
+    // in tables carved out of large chunks rather than malloc'ed one by one.
+    struct TXMap
+    {
+        struct LocHasher { uint64_t operator()(uint64_t loc) const { return (loc*0x9E3779B97F4A7C15ULL)>>20; } };
+        struct LocEqual { bool operator()(uint64_t a, uint64_t b) const { return a==b; } };
+        typedef GoogMap<uint64_t, uint32_t*, LocHasher, LocEqual>::Map OffsetMap;
+        typedef GoogMap<uint64_t, uint8_t*, LocHasher, LocEqual>::Map ScriptMap;
+
+        // Size classed free lists over chunks that are never given back: a table freed when its TX gets
+        // fully spent is reused by the next TX of about the same width
+        struct ScriptArena
+        {
+            enum
+            {
+                kGrain = 8,
+                kNbClasses = 64,            // larger tables go straight to malloc
+                kChunkSize = 1<<20,
+            };
+
+            void     *freeLists[1 + kNbClasses];
+            uint8_t  *chunk;
+            uint64_t chunkLeft;
+
+            ScriptArena() : chunk(0), chunkLeft(0) { memset(freeLists, 0, sizeof(freeLists)); }
+
+            uint8_t *alloc(uint64_t size);
+            void release(uint8_t *p, uint64_t size);
+        };
+
+        struct Slot
+        {
+            uint64_t key;
+            uint64_t loc;
+        };
+
+        enum
+        {
+            kOffsetBits = 32,
+            kMapBits = 14,
+            kCountBits = 16,
+            kCountShift = kOffsetBits + kMapBits,
+            kMinWideOutputs = 16,       // below that, walking the outputs is just as fast
+        };
+
+        static const uint64_t kOffsetMask = (1ULL<<kOffsetBits) - 1;
+        static const uint64_t kMapMask = (1ULL<<kMapBits) - 1;
+        static const uint64_t kLocMask = (1ULL<<(kOffsetBits + kMapBits)) - 1;
+        static const uint64_t kCountMask = (1ULL<<kCountBits) - 1;     // saturated count: never released
+        static const uint64_t kWide = (1ULL<<62);                        // TX has an output offset table
+        static const uint64_t kCollision = (1ULL<<63);
+
+        // Must return true iff the TX found at loc hashes to hash
+        typedef bool (*Verifier)(uint64_t loc, const uint8_t *hash);
+
+        Slot     *slots;
+        uint64_t capacity;
+        uint64_t nbEntries;
+        Verifier verifier;
+        OffsetMap outputOffsets;
+        bool keepScripts;
+        ScriptMap outputScripts;
+        ScriptArena scriptArena;
+        const AddrDict *addrDict;
+        uint64_t scriptSize;            // of one kept output: its type, then its address id or hash160
+
+        TXMap() : slots(0), capacity(0), nbEntries(0), verifier(0), keepScripts(false), addrDict(0), scriptSize(0) {}
+
+        void init(uint64_t nbExpected, Verifier v, bool scripts, const AddrDict *dict);
+        void insert(
+            const uint8_t                 *hash,
+            uint64_t                      loc,
+            uint64_t                      nbUnspent,
+            const std::vector<uint32_t>   &offsets,
+            const std::vector<ScriptInfo> &scripts
+        );
+        void erase(Slot *slot);
+        void grow();
+        void freeOffsets(uint64_t loc);
+        void freeScripts(uint64_t loc);
+
+        static inline uint64_t makeLoc(uint64_t mapIndex, uint64_t offset) { return (mapIndex<<kOffsetBits) | offset;     }
+        static inline uint64_t  locMap(uint64_t loc)                       { return (loc>>kOffsetBits) & kMapMask;        }
+        static inline uint64_t  locOffset(uint64_t loc)                    { return loc & kOffsetMask;                    }
+        static inline uint64_t  locCount(uint64_t loc)                     { return (loc>>kCountShift) & kCountMask;      }
+        uint64_t                memSize() const                            { return capacity*sizeof(Slot);                }
+
+        static inline uint64_t keyOf(
+            const uint8_t *hash
+        )
+        {
+            uint64_t key = *(const uint64_t*)hash;
+            return likely(0!=key) ? key : 1;     // 0 marks empty slots
+        }
+
+        inline uint64_t bucketOf(
+            uint64_t key
+        ) const
+        {
+            return (uint64_t)((((uint128_t)key) * capacity) >> 64);
+        }
+
+        inline uint64_t nextBucket(
+            uint64_t i
+        ) const
+        {
+            return likely((1+i)<capacity) ? (1+i) : 0;
+        }
+
+        // Returns the slot for hash, or 0 when it isn't in the table
+        inline Slot *find(
+            const uint8_t *hash
+        ) const
+        {
+            uint64_t key = keyOf(hash);
+            uint64_t i = bucketOf(key);
+            while(1) {
+
+                Slot *slot = slots + i;
+                if(unlikely(0==slot->key)) return 0;
+
+                if(likely(key==slot->key)) {
+                    bool collision = (0!=(kCollision & slot->loc));
+                    if(likely(!collision)) return slot;
+                    if(verifier(kLocMask & slot->loc, hash)) return slot;
+                }
+
+                i = nextBucket(i);
+            }
+        }
+
+        // Pulls the first bucket hash would probe into the cache
+        inline void prefetch(
+            const uint8_t *hash
+        ) const
+        {
+            __builtin_prefetch(slots + bucketOf(keyOf(hash)));
+        }
+
+        // Like find, but colliding keys aren't confirmed: only good enough to prefetch what a hit points at
+        inline const Slot *peek(
+            const uint8_t *hash
+        ) const
+        {
+            uint64_t key = keyOf(hash);
+            uint64_t i = bucketOf(key);
+            while(1) {
+                const Slot *slot = slots + i;
+                if(unlikely(0==slot->key)) return 0;
+                if(likely(key==slot->key)) return slot;
+                i = nextBucket(i);
+            }
+        }
+
+        // Offset of each output of the TX in slot, or 0 when the TX is too narrow to have a table
+        inline const uint32_t *getOffsets(
+            const Slot *slot,
+            uint64_t   &nbOutputs
+        ) const
+        {
+            if(likely(0==(kWide & slot->loc))) return 0;
+            const uint32_t *table = outputOffsets.find(kLocMask & slot->loc)->second;
+            nbOutputs = table[0];
+            return 1 + table;
+        }
+
+        // Solved script of an output of the TX in slot, false when scripts aren't kept
+        inline bool getScript(
+            const Slot *slot,
+            uint64_t   outputIndex,
+            ScriptInfo &info
+        ) const
+        {
+            if(likely(!keepScripts)) return false;
+            ScriptMap::const_iterator i = outputScripts.find(kLocMask & slot->loc);
+            if(outputScripts.end()==i) return false;
+
+            const uint8_t *table = i->second;
+            if(unlikely(*(const uint32_t*)table<=outputIndex)) return false;
+
+            const uint8_t *script = sizeof(uint32_t) + table + outputIndex*scriptSize;
+            info.type = (int8_t)script[0];
+            info.addrType[0] = (3==info.type) ? 'S' : 0;
+            info.addrType[1] = 0;
+            info.addrType[2] = 0;
+            if(addrDict) {
+                memcpy(&info.addrId, 1+script, sizeof(uint32_t));
+                if(AddrDict::kNone==info.addrId) memset(info.hash160, 0, kRIPEMD160ByteSize);
+                else memcpy(info.hash160, addrDict->hash(info.addrId), kRIPEMD160ByteSize);
+            } else {
+                info.addrId = AddrDict::kNone;
+                memcpy(info.hash160, 1+script, kRIPEMD160ByteSize);
+            }
+            return true;
+        }
+
+        // Called each time an output of the TX in slot gets spent
+        inline void spend(
+            Slot *slot
+        )
+        {
+            uint64_t count = locCount(slot->loc);
+            if(unlikely(kCountMask==count)) return;
+            if(unlikely(count<=1)) {
+                erase(slot);
+                return;
+            }
+            slot->loc -= (1ULL<<kCountShift);
+        }
+    };
+
+#endif // __TXMAP_H__
+
@@ -7,9 +7,14 @@
 #include <sha256.h>
 #include <opcodes.h>
 
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
@@ -34,6 +39,152 @@ double usecs()
     return t.tv_usec + 1000000*((uint64_t)t.tv_sec);
 }
 
+size_t getNbThreads()
+{
+    static size_t nbThreads = 0;
+    if(unlikely(0==nbThreads)) {
+        const char *s = getenv("NBTHREADS");
+        if(s) nbThreads = strtoul(s, 0, 10);
+        if(0==nbThreads) nbThreads = std::thread::hardware_concurrency();
+        if(0==nbThreads) nbThreads = 1;
+    }
+    return nbThreads;
+}
+
+const std::string &getCacheDir()
+{
+    static bool initialized = false;
+    static std::string cacheDir;
+    if(unlikely(!initialized)) {
+        initialized = true;
+
+        const char *dir = getenv("CACHEDIR");
+        if(0==dir) {
+            const char *home = getenv("HOME");
+            cacheDir = std::string(home ? home : ".") + "/.blockparser/";
+        } else if(0!=dir[0]) {
+            cacheDir = dir;
+            if('/'!=cacheDir[cacheDir.size()-1]) cacheDir += '/';
+        }
+
+        if(0<cacheDir.size()) {
+            int r = mkdir(cacheDir.c_str(), 0755);
+            if(r<0 && EEXIST!=errno) {
+                warning("couldn't create cache directory %s (%s), caching disabled", cacheDir.c_str(), strerror(errno));
+                cacheDir.clear();
+            }
+        }
+    }
+    return cacheDir;
+}
+
+static std::string gCacheSource;
+
+void setCacheSource(
+    const std::string &source
+)
+{
+    gCacheSource = source;
+}
+
+const std::string &getSourceCacheDir()
+{
+    static bool initialized = false;
+    static std::string sourceCacheDir;
+    if(unlikely(!initialized)) {
+        initialized = true;
+
+        if(0==gCacheSource.size()) errFatal("cache directory of the block chain files asked for before they were found");
+
+        const std::string &cacheDir = getCacheDir();
+        if(0<cacheDir.size()) {
+
+            char buf[32];
+            sprintf(buf, "%016" PRIx64 "/", checksum64(gCacheSource.data(), gCacheSource.size()));
+            sourceCacheDir = cacheDir + buf;
+
+            int r = mkdir(sourceCacheDir.c_str(), 0755);
+            if(r<0 && EEXIST!=errno) {
+                warning("couldn't create cache directory %s (%s), caching disabled", sourceCacheDir.c_str(), strerror(errno));
+                sourceCacheDir.clear();
+            }
+        }
+    }
+    return sourceCacheDir;
+}
+
+static const char *gHashBackendNames[kNbHashBackends] = { "flat", "dense", "sparse" };
+
+int pickHashBackend(
+    uint64_t       nbEntries,
+    const uint64_t *bytesPerEntry
+)
+{
+    static std::mutex mutex;
+    static bool initialized = false;
+    static int forced = -1;
+    static uint64_t budget = 0;
+    static uint64_t committed = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(unlikely(!initialized)) {
+        initialized = true;
+
+        const char *name = getenv("HASHMAP");
+        for(int i=0; name && i<kNbHashBackends; ++i) {
+            if(0==strcmp(name, gHashBackendNames[i])) forced = i;
+        }
+        if(name && forced<0) warning("unknown hash map backend %s, ignoring it", name);
+
+        // MAXMEMORY is in MB, defaults to 3/4 of physical RAM
+        const char *s = getenv("MAXMEMORY");
+        if(s) budget = strtoull(s, 0, 10) << 20;
+        if(0==budget) {
+            long pages = sysconf(_SC_PHYS_PAGES);
+            long pageSize = sysconf(_SC_PAGE_SIZE);
+            if(0<pages && 0<pageSize) budget = (3*(uint64_t)pages*pageSize)/4;
+            else                      budget = ~0ULL;
+        }
+    }
+
+    // Fastest first, as long as the expected size fits in what's left of the budget
+    int backend = forced;
+    if(backend<0) {
+        static const int order[] = { kHashFlat, kHashDense, kHashSparse };
+        uint64_t left = (committed<budget) ? (budget - committed) : 0;
+        backend = kHashSparse;
+        for(int i=0; i<kNbHashBackends; ++i) {
+            if(nbEntries*bytesPerEntry[order[i]]<=left) {
+                backend = order[i];
+                break;
+            }
+        }
+    }
+
+    committed += nbEntries*bytesPerEntry[backend];
+    return backend;
+}
+
+void reportHashMap(
+    const char         *name,
+    const HashMapStats &stats
+)
+{
+    char probe[64] = "n/a";
+    if(0<=stats.meanProbe) snprintf(probe, sizeof(probe), "%.2f", stats.meanProbe);
+
+    info(
+        "%s: %s hash map, %" PRIu64 " entries, load factor %.2f, mean probe %s, %.1f bytes per entry (%.2f MB)",
+        name,
+        gHashBackendNames[stats.backend],
+        stats.size,
+        stats.buckets ? stats.size/(double)stats.buckets : 0.0,
+        probe,
+        stats.size ? stats.memSize/(double)stats.size : 0.0,
+        stats.memSize*1e-6
+    );
+}
+
 void toHex(
           uint8_t *dst,     // 2*size +1
     const uint8_t *src,     // size
@@ -218,6 +369,234 @@ bool decompressPublicKey(
     return true;
 }
 
+uint64_t decompressAmount(
+    uint64_t x
+)
+{
+    // Inverse of Bitcoin Core's CompressAmount
+    if(0==x) return 0;
+
+    --x;
+    int e = x % 10;
+    x /= 10;
+
+    uint64_t n = 0;
+    if(e<9) {
+        uint64_t d = (x % 9) + 1;
+        x /= 9;
+        n = x*10 + d;
+    } else {
+        n = x + 1;
+    }
+
+    while(e--) n *= 10;
+    return n;
+}
+
+const uint8_t *decompressScript(
+          uint8_t  *buf,
+    const uint8_t  *&p,
+          uint64_t &scriptSize
+)
+{
+    // Inverse of Bitcoin Core's ScriptCompression, advances p past the compressed script
+    uint64_t type = loadCoreVarInt(p);
+    switch(type) {
+
+        // Pays to hash160(pubKey)
+        case 0x00: {
+            buf[0] = 0x76;                          // OP_DUP
+            buf[1] = 0xA9;                          // OP_HASH160
+            buf[2] = 20;                            // OP_PUSHDATA(20)
+            memcpy(3+buf, p, kRIPEMD160ByteSize);
+            buf[23] = 0x88;                         // OP_EQUALVERIFY
+            buf[24] = 0xAC;                         // OP_CHECKSIG
+            p += kRIPEMD160ByteSize;
+            scriptSize = 25;
+            return buf;
+        }
+
+        // Pays to hash160(script)
+        case 0x01: {
+            buf[0] = 0xA9;                          // OP_HASH160
+            buf[1] = 20;                            // OP_PUSHDATA(20)
+            memcpy(2+buf, p, kRIPEMD160ByteSize);
+            buf[22] = 0x87;                         // OP_EQUAL
+            p += kRIPEMD160ByteSize;
+            scriptSize = 23;
+            return buf;
+        }
+
+        // Pays to explicit compressed pubKey
+        case 0x02:
+        case 0x03: {
+            buf[0] = 33;                            // OP_PUSHDATA(33)
+            buf[1] = (uint8_t)type;
+            memcpy(2+buf, p, 32);
+            buf[34] = 0xAC;                         // OP_CHECKSIG
+            p += 32;
+            scriptSize = 35;
+            return buf;
+        }
+
+        // Pays to explicit uncompressed pubKey, stored compressed
+        case 0x04:
+        case 0x05: {
+            uint8_t compressedKey[33];
+            compressedKey[0] = (uint8_t)(type - 2);
+            memcpy(1+compressedKey, p, 32);
+            p += 32;
+
+            buf[0] = 65;                            // OP_PUSHDATA(65)
+            bool ok = decompressPublicKey(1+buf, compressedKey);
+            if(!ok) errFatal("invalid compressed pubKey in undo data");
+            buf[66] = 0xAC;                         // OP_CHECKSIG
+            scriptSize = 67;
+            return buf;
+        }
+    }
+
+    // Anything else is stored as is, its size biased by the number of special types
+    const uint8_t *script = p;
+    scriptSize = type - 6;
+    p += scriptSize;
+    return script;
+}
+
+void hash160Many(
+          uint8_t *const *results,
+    const uint8_t *const *data,
+    const size_t         *sizes,
+    size_t               n
+)
+{
+    static thread_local std::vector<uint256_t> shas;
+    static thread_local std::vector<uint8_t*> shaPtrs;
+    shas.resize(n);
+    shaPtrs.resize(n);
+    for(size_t i=0; i<n; ++i) shaPtrs[i] = shas[i].v;
+
+    sha256Many(shaPtrs.data(), data, sizes, n);
+    for(size_t i=0; i<n; ++i) rmd160(results[i], shas[i].v, kSHA256ByteSize);
+}
+
+// Hash160 of recently seen pubKeys: pay to pubKey outputs are solved once when
+// created and once more when spent, and early coinbase keys get reused a lot.
+// Direct mapped, one table per thread, a new key simply evicts the old one.
+struct PubKeyCacheEntry
+{
+    uint8_t size;
+    uint8_t pubKey[65];
+    uint8_t hash160[kRIPEMD160ByteSize];
+};
+
+enum { kPubKeyCacheBits = 17 };
+static thread_local std::vector<PubKeyCacheEntry> gPubKeyCache;
+
+static PubKeyCacheEntry *pubKeyCacheEntry(
+    const uint8_t *pubKey
+)
+{
+    if(unlikely(0==gPubKeyCache.size())) gPubKeyCache.resize(1<<kPubKeyCacheBits);
+
+    // Bytes past the prefix are a curve coordinate, as good as random
+    uint64_t key;
+    memcpy(&key, 1+pubKey, sizeof(key));
+    return &gPubKeyCache[(key*0x9E3779B97F4A7C15ULL)>>(64 - kPubKeyCacheBits)];
+}
+
+static bool findPubKeyHash(
+          uint8_t *hash160,
+    const uint8_t *pubKey,
+    size_t        size
+)
+{
+    const PubKeyCacheEntry *entry = pubKeyCacheEntry(pubKey);
+    if(size!=entry->size || 0!=memcmp(entry->pubKey, pubKey, size)) return false;
+    memcpy(hash160, entry->hash160, kRIPEMD160ByteSize);
+    return true;
+}
+
+static void keepPubKeyHash(
+    const uint8_t *hash160,
+    const uint8_t *pubKey,
+    size_t        size
+)
+{
+    PubKeyCacheEntry *entry = pubKeyCacheEntry(pubKey);
+    entry->size = size;
+    memcpy(entry->pubKey, pubKey, size);
+    memcpy(entry->hash160, hash160, kRIPEMD160ByteSize);
+}
+
+static void hashPubKey(
+          uint8_t *hash160,
+    const uint8_t *pubKey,
+    size_t        size
+)
+{
+    if(likely(findPubKeyHash(hash160, pubKey, size))) return;
+
+    uint256_t sha;
+    sha256(sha.v, pubKey, size);
+    rmd160(hash160, sha.v, kSHA256ByteSize);
+    keepPubKeyHash(hash160, pubKey, size);
+}
+
+// Size of the pubKey a pay to pubKey script carries, 0 for other scripts
+static inline size_t payToPubKeySize(
+    const uint8_t *script,
+    uint64_t      scriptSize
+)
+{
+    bool p2pk = (
+        (67==scriptSize || 35==scriptSize)  &&
+        (scriptSize - 2)==script[0]         &&  // OP_PUSHDATA(65 or 33)
+        0xAC==script[scriptSize-1]              // OP_CHECKSIG
+    );
+    return p2pk ? (scriptSize - 2) : 0;
+}
+
+void solveOutputScripts(
+          uint8_t  *pubKeyHashes,
+          int      *results,
+          uint8_t  *types,
+    const uint8_t  *const *scripts,
+    const uint64_t *scriptSizes,
+    size_t         n
+)
+{
+    // Pay to pubKey scripts whose key isn't cached are left for last, and hashed together
+    static thread_local std::vector<size_t> missing;
+    static thread_local std::vector<uint8_t*> hashes;
+    static thread_local std::vector<const uint8_t*> pubKeys;
+    static thread_local std::vector<size_t> sizes;
+    missing.clear();
+    hashes.clear();
+    pubKeys.clear();
+    sizes.clear();
+
+    for(size_t i=0; i<n; ++i) {
+
+        uint8_t *hash160 = pubKeyHashes + i*kRIPEMD160ByteSize;
+        size_t size = payToPubKeySize(scripts[i], scriptSizes[i]);
+        if(0==size || findPubKeyHash(hash160, 1+scripts[i], size)) {
+            results[i] = solveOutputScript(hash160, scripts[i], scriptSizes[i], types + 2*i);
+            continue;
+        }
+
+        types[2*i] = 0;
+        results[i] = (65==size) ? 1 : 2;
+        missing.push_back(i);
+        hashes.push_back(hash160);
+        pubKeys.push_back(1+scripts[i]);
+        sizes.push_back(size);
+    }
+
+    hash160Many(hashes.data(), pubKeys.data(), sizes.data(), hashes.size());
+    for(size_t j=0; j<missing.size(); ++j) keepPubKeyHash(hashes[j], pubKeys[j], sizes[j]);
+}
+
 int solveOutputScript(
           uint8_t *pubKeyHash,
     const uint8_t *script,
@@ -252,9 +631,7 @@ int solveOutputScript(
         )
     )
     {
-        uint256_t sha;
-        sha256(sha.v, 1+script, 65);
-        rmd160(pubKeyHash, sha.v, kSHA256ByteSize);
+        hashPubKey(pubKeyHash, 1+script, 65);
         return 1;
     }
 
@@ -271,9 +648,7 @@ int solveOutputScript(
         //bool ok = decompressPublicKey(pubKey, 1+script);
         //if(!ok) return -3;
 
-        uint256_t sha;
-        sha256(sha.v, 1+script, 33);
-        rmd160(pubKeyHash, sha.v, kSHA256ByteSize);
+        hashPubKey(pubKeyHash, 1+script, 33);
         return 2;
     }
 
@@ -341,6 +716,26 @@ const uint8_t *loadKeyHash(
     return hash;
 }
 
+uint64_t checksum64(
+    const void *buf,
+    size_t     size
+)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ size;
+    const uint8_t *p = (const uint8_t*)buf;
+    const uint8_t *e = size + p;
+    while(likely((8+p)<=e)) {
+        LOAD(uint64_t, w, p);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= (h>>29);
+    }
+    while(p<e) {
+        LOAD(uint8_t, c, p);
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
 uint8_t fromB58Digit(
     uint8_t digit,
        bool abortOnErr
@@ -11,8 +11,6 @@
     typedef const uint8_t *Hash256;
     struct uint160_t { uint8_t v[kRIPEMD160ByteSize]; };
     struct uint256_t { uint8_t v[   kSHA256ByteSize]; };
-    typedef signed int int128_t __attribute__((mode(TI)));
-    typedef unsigned int uint128_t __attribute__((mode(TI)));
     struct Hash160Hasher { uint64_t operator()( const Hash160 &hash160) const { uintptr_t i = reinterpret_cast<uintptr_t>(hash160); const uint64_t *p = reinterpret_cast<const uint64_t*>(i); return p[0]; } };
     struct Hash256Hasher { uint64_t operator()( const Hash256 &hash256) const { uintptr_t i = reinterpret_cast<uintptr_t>(hash256); const uint64_t *p = reinterpret_cast<const uint64_t*>(i); return p[0]; } };
 
@@ -66,6 +64,7 @@
         int64_t       height;
         Block         *prev;
         Block         *next;
+        uint32_t      mapIndex;
     };
 
     template<
@@ -95,71 +94,304 @@
     static inline uint8_t *allocHash256() { return         PagedAllocator<uint256_t>::alloc(); }
     static inline uint8_t *allocHash160() { return         PagedAllocator<uint160_t>::alloc(); }
 
-//    #define WANT_DENSE
-    #if defined(WANT_DENSE)
+    #include <flatmap.h>
+    #include <google/dense_hash_map>
+    #include <google/sparse_hash_map>
 
-        // Faster, uses more RAM
+    // Hash map implementations GoogMap can run on, picked for each map at runtime (see pickHashBackend)
+    enum HashBackend
+    {
+        kHashFlat,      // swiss table (see flatmap.h): fast, moderate RAM
+        kHashDense,     // google::dense_hash_map: fast, uses the most RAM
+        kHashSparse,    // google::sparse_hash_map: slower, uses the least RAM
+        kNbHashBackends
+    };
 
-        #include <google/dense_hash_map>
+    struct HashMapStats
+    {
+        int      backend;
+        uint64_t size;
+        uint64_t buckets;
+        uint64_t memSize;
+        double   meanProbe;     // groups read per lookup of a present key, <0 when the backend can't tell
+    };
+
+    // Backend for a map expected to hold nbEntries entries costing bytesPerEntry[backend] each
+    int pickHashBackend(
+        uint64_t       nbEntries,
+        const uint64_t *bytesPerEntry
+    );
+
+    void reportHashMap(
+        const char         *name,
+        const HashMapStats &stats
+    );
+
+    template<
+        typename Key,
+        typename Value,
+        typename Hasher,
+        typename Equal
+    >
+    struct GoogMap
+    {
+        typedef FlatMap<Key, Value, Hasher, Equal>                 FlatBase;
+        typedef google::dense_hash_map<Key, Value, Hasher, Equal>  DenseBase;
+        typedef google::sparse_hash_map<Key, Value, Hasher, Equal> SparseBase;
+        typedef std::pair<const Key, Value>                        value_type;
 
         template<
-            typename Key,
-            typename Value,
-            typename Hasher,
-            typename Equal
+            bool     isConst,
+            typename FlatIt,
+            typename DenseIt,
+            typename SparseIt
         >
-        struct GoogMap
+        struct Iter
         {
-            typedef google::dense_hash_map<
-                Key,
-                Value,
-                Hasher,
-                Equal
-            > MapBase;
-
-            struct Map:public MapBase
+            typedef typename std::conditional<isConst, const value_type, value_type>::type Entry;
+
+            int      backend;
+            FlatIt   f;
+            DenseIt  d;
+            SparseIt s;
+
+            Iter() : backend(kHashFlat) {}
+
+            template<typename I>
+            Iter(const I &o) : backend(o.backend), f(o.f), d(o.d), s(o.s) {}
+
+            Entry &operator*() const
             {
-                void setEmptyKey(
-                    const Key &empty
-                )
-                {
-                    this->set_empty_key(empty);
+                switch(backend) {
+                    case kHashFlat:  return *f;
+                    case kHashDense: return *d;
+                    default:         return *s;
                 }
-            };
-        };
+            }
 
-    #else
+            Entry *operator->() const { return &**this; }
 
-        // Slower, uses less RAM
+            Iter &operator++()
+            {
+                switch(backend) {
+                    case kHashFlat:  ++f; break;
+                    case kHashDense: ++d; break;
+                    default:         ++s; break;
+                }
+                return *this;
+            }
 
-        #include <google/sparse_hash_map>
+            Iter operator++(int)
+            {
+                Iter r = *this;
+                ++*this;
+                return r;
+            }
 
-        template<
-            typename Key,
-            typename Value,
-            typename Hasher,
-            typename Equal
-        >
-        struct GoogMap
-        {
-            typedef google::sparse_hash_map<
-                Key,
-                Value,
-                Hasher,
-                Equal
-            > MapBase;
-
-            struct Map:public MapBase
+            bool operator==(const Iter &o) const
             {
-                void setEmptyKey(
-                    const Key &empty
-                )
-                {
+                switch(backend) {
+                    case kHashFlat:  return f==o.f;
+                    case kHashDense: return d==o.d;
+                    default:         return s==o.s;
                 }
-            };
+            }
+
+            bool operator!=(const Iter &o) const { return !(*this==o); }
         };
 
-    #endif
+        // The backend gets picked on the first insertion, or on a resize() that tells how big the map
+        // will get, and only that one ever gets allocated. Until then the map is an empty flat one.
+        struct Map
+        {
+            typedef Iter<
+                false,
+                typename FlatBase::iterator,
+                typename DenseBase::iterator,
+                typename SparseBase::iterator
+            > iterator;
+
+            typedef Iter<
+                true,
+                typename FlatBase::const_iterator,
+                typename DenseBase::const_iterator,
+                typename SparseBase::const_iterator
+            > const_iterator;
+
+            int        backend;
+            FlatBase   *flat;
+            DenseBase  *dense;
+            SparseBase *sparse;
+            Key        emptyKey;
+            Key        deletedKey;
+            bool       hasEmptyKey;
+            bool       hasDeletedKey;
+
+            Map() : backend(-1), flat(0), dense(0), sparse(0), emptyKey(), deletedKey(), hasEmptyKey(false), hasDeletedKey(false) {}
+
+            ~Map()
+            {
+                delete flat;
+                delete dense;
+                delete sparse;
+            }
+
+            inline int active() const { return likely(0<=backend) ? backend : kHashFlat; }
+
+            // Stands in for the backend before one is picked
+            static FlatBase &emptyFlat()
+            {
+                static FlatBase empty;
+                return empty;
+            }
+
+            inline FlatBase &flatOrEmpty() const { return likely(0!=flat) ? *flat : emptyFlat(); }
+
+            void pick(
+                size_t nbEntries
+            )
+            {
+                uint64_t bytesPerEntry[kNbHashBackends];
+                bytesPerEntry[kHashFlat] = ((sizeof(value_type) + 1)*7)/4;     // 7/8 max load, half that right after growing
+                bytesPerEntry[kHashDense] = sizeof(value_type)*3;              // 1/2 max load, 1/4 right after growing
+                bytesPerEntry[kHashSparse] = sizeof(value_type) + 2;
+                backend = pickHashBackend(nbEntries, bytesPerEntry);
+
+                // dense_hash_map can't work without an empty key
+                if(kHashDense==backend && !hasEmptyKey) backend = kHashFlat;
+                switch(backend) {
+                    case kHashFlat:
+                        flat = new FlatBase;
+                        break;
+                    case kHashDense:
+                        dense = new DenseBase;
+                        dense->set_empty_key(emptyKey);
+                        if(hasDeletedKey) dense->set_deleted_key(deletedKey);
+                        break;
+                    default:
+                        sparse = new SparseBase;
+                        if(hasDeletedKey) sparse->set_deleted_key(deletedKey);
+                        break;
+                }
+            }
+
+            void setEmptyKey(
+                const Key &empty
+            )
+            {
+                emptyKey = empty;
+                hasEmptyKey = true;
+            }
+
+            void set_deleted_key(
+                const Key &deleted
+            )
+            {
+                deletedKey = deleted;
+                hasDeletedKey = true;
+            }
+
+            void resize(
+                size_t n
+            )
+            {
+                if(backend<0) pick(n);
+                switch(backend) {
+                    case kHashFlat:  flat->resize(n);   break;
+                    case kHashDense: dense->resize(n);  break;
+                    default:         sparse->resize(n); break;
+                }
+            }
+
+            size_t size() const
+            {
+                switch(active()) {
+                    case kHashFlat:  return flatOrEmpty().size();
+                    case kHashDense: return dense->size();
+                    default:         return sparse->size();
+                }
+            }
+
+            Value &operator[](
+                const Key &key
+            )
+            {
+                if(unlikely(backend<0)) pick(0);
+                switch(backend) {
+                    case kHashFlat:  return (*flat)[key];
+                    case kHashDense: return (*dense)[key];
+                    default:         return (*sparse)[key];
+                }
+            }
+
+            void erase(
+                iterator i
+            )
+            {
+                switch(backend) {
+                    case kHashFlat:  flat->erase(i.f);   break;
+                    case kHashDense: dense->erase(i.d);  break;
+                    default:         sparse->erase(i.s); break;
+                }
+            }
+
+            #define GOOGMAP_DISPATCH(It, call, cq)                                          \
+                It i;                                                                       \
+                i.backend = active();                                                       \
+                switch(i.backend) {                                                         \
+                    case kHashFlat:  i.f = ((cq FlatBase&)flatOrEmpty()).call;  break;      \
+                    case kHashDense: i.d = ((cq DenseBase*)dense)->call;        break;      \
+                    default:         i.s = ((cq SparseBase*)sparse)->call;      break;      \
+                }                                                                           \
+                return i;                                                                   \
+
+                iterator       find(const Key &key)       { GOOGMAP_DISPATCH(iterator, find(key), );            }
+                const_iterator find(const Key &key) const { GOOGMAP_DISPATCH(const_iterator, find(key), const); }
+                iterator       begin()                    { GOOGMAP_DISPATCH(iterator, begin(), );              }
+                const_iterator begin()              const { GOOGMAP_DISPATCH(const_iterator, begin(), const);   }
+                iterator       end()                      { GOOGMAP_DISPATCH(iterator, end(), );                }
+                const_iterator end()                const { GOOGMAP_DISPATCH(const_iterator, end(), const);     }
+
+            #undef GOOGMAP_DISPATCH
+
+            HashMapStats stats() const
+            {
+                HashMapStats r;
+                r.backend = active();
+                r.size = size();
+                switch(r.backend) {
+                    case kHashFlat:
+                        r.buckets = flatOrEmpty().bucket_count();
+                        r.memSize = flatOrEmpty().memSize();
+                        r.meanProbe = flatOrEmpty().meanProbeLength();
+                        break;
+                    case kHashDense:
+                        r.buckets = dense->bucket_count();
+                        r.memSize = dense->bucket_count()*sizeof(value_type);
+                        r.meanProbe = -1;
+                        break;
+                    default:
+                        r.buckets = sparse->bucket_count();
+                        r.memSize = sparse->size()*sizeof(value_type) + sparse->bucket_count()/4;
+                        r.meanProbe = -1;
+                        break;
+                }
+                return r;
+            }
+
+            void report(
+                const char *name
+            ) const
+            {
+                reportHashMap(name, stats());
+            }
+
+        private:
+
+            Map(const Map &);
+            Map &operator=(const Map &);
+        };
+    };
 
     #define SKIP(type, var, p)       \
         p += sizeof(type)            \
@@ -182,7 +414,28 @@
                               LOAD(uint64_t, v, p); return v;
     }
 
+    // Bitcoin Core's own VARINT (MSB base-128), used in undo files -- not the same as the above
+    static inline uint64_t loadCoreVarInt(
+        const uint8_t *&p
+    )
+    {
+        uint64_t r = 0;
+        while(1) {
+            uint8_t c = *(p++);
+            r = (r<<7) | (c & 0x7F);
+            if(0==(c & 0x80)) return r;
+            ++r;
+        }
+    }
+
     double usecs();
+    size_t getNbThreads();
+    const std::string &getCacheDir();
+
+    // Cached files that depend on the block chain files (block index, TX hashes, address ids) live in a
+    // subdirectory of the cache directory keyed on where those files come from, see setCacheSource
+    void setCacheSource(const std::string &source);
+    const std::string &getSourceCacheDir();
 
     void toHex(
               uint8_t *dst,
@@ -227,6 +480,16 @@
         const uint8_t *compressedKey
     );
 
+    uint64_t decompressAmount(
+        uint64_t x
+    );
+
+    const uint8_t *decompressScript(
+              uint8_t  *buf,        // 67 bytes
+        const uint8_t  *&p,
+              uint64_t &scriptSize
+    );
+
     int solveOutputScript(
               uint8_t *pubKeyHash,
         const uint8_t *script,
@@ -234,6 +497,33 @@
         uint8_t       *type
     );
 
+    // What solveOutputScript found for one output, type<0 if the script couldn't be solved
+    struct ScriptInfo
+    {
+        int     type;
+        uint8_t addrType[3];
+        uint8_t hash160[kRIPEMD160ByteSize];
+        uint32_t addrId;    // dense id of hash160 (see addrdict.h), ~0 if unsolved or not asked for
+    };
+
+    // solveOutputScript over n scripts, pubKeys that need hashing get hashed together
+    void solveOutputScripts(
+              uint8_t  *pubKeyHashes,       // n x 20 bytes
+              int      *results,            // what solveOutputScript returns for each script
+              uint8_t  *types,              // n x 2 bytes
+        const uint8_t  *const *scripts,
+        const uint64_t *scriptSizes,
+        size_t         n
+    );
+
+    // rmd160(sha256(data[i])) into results[i], sha256 done several at a time
+    void hash160Many(
+              uint8_t *const *results,
+        const uint8_t *const *data,
+        const size_t         *sizes,
+        size_t               n
+    );
+
     static inline void sha256Twice(
               uint8_t *sha,
         const uint8_t *buf,
@@ -244,6 +534,30 @@
         sha256(sha, sha, kSHA256ByteSize);
     }
 
+    // Block hash, i.e. sha256Twice of the 80 byte header, on the fixed size fast path
+    static inline void hashHeader(
+              uint8_t *hash,
+        const uint8_t *header
+    )
+    {
+        sha256Twice80(hash, header);
+    }
+
+    // Same for many headers at once, several get hashed per pass on SIMD engines
+    static inline void hashHeaders(
+              uint8_t *const *hashes,
+        const uint8_t *const *headers,
+        size_t               n
+    )
+    {
+        sha256Twice80Many(hashes, headers, n);
+    }
+
+    uint64_t checksum64(
+        const void *buf,
+        size_t     size
+    );
+
     extern const uint8_t hexDigits[];
     extern const uint8_t b58Digits[];
 